@@ -2,6 +2,7 @@
 #include "htslib/hts.h"
 #include "htslib/sam.h"
 #include "htslib/vcf.h"
+#include "htslib/tbx.h"
 using namespace Rcpp;
 using namespace std;
 
@@ -22,6 +23,119 @@ std::string check_format(std::string fname) {
     return std::string(hts_format_description(fmt));
 }
 
+// owns the index loaded by idxstats, whichever of the three kinds it is
+struct IndexStats {
+    IndexStats() : fp(NULL), idx(NULL), tbx(NULL), sam_hdr(NULL), vcf_hdr(NULL) {}
+    ~IndexStats() {
+        if (tbx) tbx_destroy(tbx);
+        if (idx) hts_idx_destroy(idx);
+        if (sam_hdr) bam_hdr_destroy(sam_hdr);
+        if (vcf_hdr) bcf_hdr_destroy(vcf_hdr);
+        if (fp) hts_close(fp);
+    }
+    htsFile *fp;
+    hts_idx_t *idx; // owned here unless tbx is set, which owns its own
+    tbx_t *tbx;
+    bam_hdr_t *sam_hdr;
+    bcf_hdr_t *vcf_hdr;
+};
+
+//' per-contig record counts from the index alone, like samtools idxstats
+//' @param file the SAM/BAM/CRAM or VCF/BCF file
+//' @param index the BAI/CSI/CRAI or CSI/TBI index file path, or NULL to look for one next to the file
+//' @description Use this function to see how many records each contig holds, e.g. to plan region-sharded jobs,
+//' without reading any records. BAI and CSI indexes keep these counts in a pseudo-bin, so the answer comes from
+//' the index metadata in milliseconds. Tabix and CSI indexes of VCF files count every record as mapped.
+//' @details Counts are NA when the index has no statistics for a contig, e.g. for CRAM or for indexes written
+//' by old tools. BAM and CRAM files get a final row, "*", with the reads without a coordinate. length is NA
+//' when the header doesn't give it.
+//' @return a dataframe with the chrom, length, mapped and unmapped counts of each contig in the index
+//' @examples
+//' \dontrun{
+//' stats <- idxstats(bam, paste0(bam, ".bai"))
+//' stats[order(-stats$mapped), ]
+//' }
+// [[Rcpp::export]]
+DataFrame idxstats(std::string file, Nullable<CharacterVector> index = R_NilValue) {
+    IndexStats s;
+    s.fp = hts_open(file.c_str(), "r");
+    if (!s.fp) stop("couldn't open " + file);
+    std::string fnidx = index.isNull() ? std::string() : as<std::string>(index.get());
+    const htsFormat *fmt = hts_get_format(s.fp);
+
+    std::vector<std::string> names;
+    std::vector<double> lengths;
+    std::vector<int> tids; // what hts_idx_get_stat takes for each name
+    if (fmt->category == sequence_data) {
+        s.sam_hdr = sam_hdr_read(s.fp);
+        if (!s.sam_hdr) stop("couldn't read header of " + file);
+        s.idx = fnidx.empty() ? sam_index_load(s.fp, file.c_str()) : sam_index_load2(s.fp, file.c_str(), fnidx.c_str());
+        if (!s.idx) stop("couldn't load index of " + file);
+        for (int i = 0; i < s.sam_hdr->n_targets; i++) {
+            names.push_back(s.sam_hdr->target_name[i]);
+            tids.push_back(i);
+            lengths.push_back(s.sam_hdr->target_len[i]);
+        }
+    } else if (fmt->category == variant_data) {
+        s.vcf_hdr = bcf_hdr_read(s.fp);
+        if (!s.vcf_hdr) stop("couldn't read header of " + file);
+        // like VcfReader: BCF and explicitly given .csi files use the CSI path, other VCFs tabix
+        bool use_csi = fnidx.empty() ? fmt->format == bcf : fnidx.find("csi") != std::string::npos;
+        const char **seqnames = NULL;
+        int n = 0;
+        if (use_csi) {
+            s.idx = fnidx.empty() ? bcf_index_load(file.c_str()) : bcf_index_load2(file.c_str(), fnidx.c_str());
+            if (!s.idx) stop("couldn't load index of " + file);
+            seqnames = bcf_index_seqnames(s.idx, s.vcf_hdr, &n);
+        } else {
+            s.tbx = fnidx.empty() ? tbx_index_load(file.c_str()) : tbx_index_load2(file.c_str(), fnidx.c_str());
+            if (!s.tbx) stop("couldn't load index of " + file);
+            s.idx = s.tbx->idx;
+            seqnames = tbx_seqnames(s.tbx, &n);
+        }
+        // CSI ids are the header's contig ids, and bcf_index_seqnames skips contigs without
+        // records, so the position in seqnames isn't the id; TBI's names are in its own id order
+        for (int i = 0; i < n; i++) {
+            names.push_back(seqnames[i]);
+            int rid = bcf_hdr_name2id(s.vcf_hdr, seqnames[i]);
+            tids.push_back(use_csi ? rid : i);
+            int len = rid >= 0 ? s.vcf_hdr->id[BCF_DT_CTG][rid].val->info[0] : 0;
+            lengths.push_back(len > 0 ? len : NA_REAL);
+        }
+        free(seqnames);
+    } else {
+        stop("idxstats needs a SAM/BAM/CRAM or VCF/BCF file");
+    }
+
+    int n = names.size();
+    bool reads = fmt->category == sequence_data;
+    int rows = n + reads;
+    CharacterVector chroms(rows);
+    NumericVector length(rows), mapped(rows), unmapped(rows);
+    for (int i = 0; i < n; i++) {
+        uint64_t m = 0, u = 0;
+        bool has_stat = tids[i] >= 0 && hts_idx_get_stat(s.idx, tids[i], &m, &u) >= 0;
+        chroms[i] = names[i];
+        length[i] = lengths[i];
+        mapped[i] = has_stat ? (double) m : NA_REAL;
+        unmapped[i] = has_stat ? (double) u : NA_REAL;
+    }
+    if (reads) {
+        chroms[n] = "*";
+        length[n] = 0;
+        mapped[n] = 0;
+        unmapped[n] = (double) hts_idx_get_n_no_coor(s.idx);
+    }
+    if (s.tbx) s.idx = NULL; // tbx_destroy frees it
+
+    return DataFrame::create(
+        Named("chrom") = chroms,
+        Named("length") = length,
+        Named("mapped") = mapped,
+        Named("unmapped") = unmapped
+    );
+}
+
 //' Extract the sequences for a given region
 //' @param bam the cram/bam/sam file
 //' @param index the index of the cram/bam/sam file
@@ -72,24 +186,44 @@ int count_kmer_seq(const std::string& seq, const std::string& kmer)
     return count;
 }
 
+// query reg through the index, or stream the whole file when reg is NULL.
+// Returns NULL when streaming; the caller then reads with sam_read1.
+static hts_itr_t *open_reads(htsFile *fp, bam_hdr_t *hdr, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                             int threads) {
+    if (threads > 1) hts_set_threads(fp, threads);
+    if (reg.isNull()) return NULL;
+    if (index.isNull()) stop("an index is needed for a region query");
+    hts_idx_t *idx = sam_index_load(fp, as<std::string>(index.get()).c_str());
+    if (!idx) stop("couldn't load index " + as<std::string>(index.get()));
+    hts_itr_t *itr = sam_itr_querys(idx, hdr, as<std::string>(reg.get()).c_str());
+    hts_idx_destroy(idx);
+    if (!itr) stop("itr is null for region " + as<std::string>(reg.get()));
+    return itr;
+}
+
+static inline int next_read(htsFile *fp, bam_hdr_t *hdr, hts_itr_t *itr, bam1_t *b) {
+    return itr ? sam_itr_next(fp, itr, b) : sam_read1(fp, hdr, b);
+}
+
 //' count the number of times a kmer is present in a region
 //' @param bam the cram/bam/sam file
-//' @param index the index of the cram/bam/sam file
-//' @param reg the region of interest, typically in format of chr1:start-begin
+//' @param index the index of the cram/bam/sam file, or NULL when reg is NULL
+//' @param reg the region of interest, typically in format of chr1:start-begin, or NULL to stream every read
+//' in the file sequentially, without an index
 //' @param kmer the substring to search for in the reads
+//' @param threads the number of threads used for BGZF decompression
 //' @return a dataframe with the sequnce reads and counts of the given kmer per read (i.e. two columns)
 //' @examples
 //' \dontrun{count_kmer(bam, index, "chr1:10001-100050", "TTACGG")}
 // [[Rcpp::export]]
-DataFrame count_kmer(std::string bam, std::string index, const std::string& reg, const std::string& kmer) {
+DataFrame count_kmer(std::string bam, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, const std::string& kmer,
+                     int threads = 1) {
     htsFile *fp = hts_open(bam.c_str(), "r");
 
     int count = 0;
     IntegerVector counts; 
-    hts_idx_t *idx = sam_index_load(fp, index.c_str());
     bam_hdr_t *hdr = sam_hdr_read(fp);
-    hts_itr_t *itr = sam_itr_querys(idx, hdr, reg.c_str());
-    hts_idx_destroy(idx);
+    hts_itr_t *itr = open_reads(fp, hdr, index, reg, threads);
 
     bam1_t *b = NULL;
     b = bam_init1();
@@ -98,7 +232,7 @@ DataFrame count_kmer(std::string bam, std::string index, const std::string& reg,
     bam1_core_t *c = NULL;
     std::string seq_str("");
     CharacterVector sequences;
-    while((r = sam_itr_next(fp, itr, b)) >= 0) {
+    while((r = next_read(fp, hdr, itr, b)) >= 0) {
         c = &b->core;
         seq = bam_get_seq(b);
         seq_str = "";
@@ -109,7 +243,7 @@ DataFrame count_kmer(std::string bam, std::string index, const std::string& reg,
         count = count_kmer_seq(seq_str, kmer);
         counts.push_back(count);
     }
-    hts_itr_destroy(itr);
+    if (itr) hts_itr_destroy(itr);
 
     return DataFrame::create(
         Named("seq") = sequences,
@@ -119,21 +253,21 @@ DataFrame count_kmer(std::string bam, std::string index, const std::string& reg,
 
 //' Calculate the GC content for a region
 //' @param bam the cram/bam/sam file
-//' @param index the index of the cram/bam/sam file
-//' @param reg the region of interest, typically in format of chr1:start-begin
+//' @param index the index of the cram/bam/sam file, or NULL when reg is NULL
+//' @param reg the region of interest, typically in format of chr1:start-begin, or NULL to stream every read
+//' in the file sequentially, without an index
+//' @param threads the number of threads used for BGZF decompression
 //' @return a dataframe with the sequnce reads, counts of GC bases, and proportion of GC per read
 //' @examples
 //' \dontrun{gc_content(bam, index, "chr1:10001-100050")}
 //[[Rcpp::export]]
-DataFrame gc_content(std::string bam, std::string index, const std::string& reg) {
+DataFrame gc_content(std::string bam, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, int threads = 1) {
     htsFile *fp = hts_open(bam.c_str(), "r");
 
     IntegerVector counts; 
     NumericVector props; 
-    hts_idx_t *idx = sam_index_load(fp, index.c_str());
     bam_hdr_t *hdr = sam_hdr_read(fp);
-    hts_itr_t *itr = sam_itr_querys(idx, hdr, reg.c_str());
-    hts_idx_destroy(idx);
+    hts_itr_t *itr = open_reads(fp, hdr, index, reg, threads);
 
     bam1_t *b = NULL;
     b = bam_init1();
@@ -145,7 +279,7 @@ DataFrame gc_content(std::string bam, std::string index, const std::string& reg)
     int count_c = 0;
     int count_g = 0;
     int count_gc = 0;
-    while((r = sam_itr_next(fp, itr, b)) >= 0) {
+    while((r = next_read(fp, hdr, itr, b)) >= 0) {
         c = &b->core;
         seq = bam_get_seq(b);
         seq_str = "";
@@ -159,7 +293,7 @@ DataFrame gc_content(std::string bam, std::string index, const std::string& reg)
         counts.push_back(count_gc);
         props.push_back(count_gc * 1.0 / seq_str.length());
     }
-    hts_itr_destroy(itr);
+    if (itr) hts_itr_destroy(itr);
 
     return DataFrame::create(
         Named("seq") = sequences,
@@ -253,3 +387,75 @@ DataFrame depth(std::string bam, std::string index, const std::string& reg) {
     );
 }
 
+// owns the handles of write_bam so stop() part way through still closes them
+struct BamCopy {
+    BamCopy() : fp(NULL), hdr(NULL), itr(NULL), out_fp(NULL), b(bam_init1()) {}
+    ~BamCopy() {
+        bam_destroy1(b);
+        if (itr) hts_itr_destroy(itr);
+        if (out_fp) hts_close(out_fp);
+        if (hdr) bam_hdr_destroy(hdr);
+        if (fp) hts_close(fp);
+    }
+    htsFile *fp;
+    bam_hdr_t *hdr;
+    hts_itr_t *itr;
+    htsFile *out_fp;
+    bam1_t *b;
+};
+
+//' write the reads of a region to a new BAM/SAM file
+//' @param bam the cram/bam/sam file
+//' @param index the index of the cram/bam/sam file, or NULL when reg is NULL
+//' @param reg the region of interest, typically in format of chr1:start-begin, or NULL to stream every read
+//' in the file sequentially, without an index
+//' @param out the output path. A name ending in .sam writes SAM, anything else BAM.
+//' @param min_mapq drop reads with a mapping quality below this
+//' @param level the compression level (0-9) of BAM output, or -1 for the htslib default
+//' @param write_index build a BAI index (out.bai) while writing. Only BAM output can be indexed on the fly.
+//' @param threads the number of threads used to decompress the input and, separately, to compress the output
+//' @description Use this function to save a region of reads for other tools in one streaming pass instead of
+//' shelling out to samtools. Reads are copied without being decoded.
+//' @return the number of reads written
+//' @examples
+//' \dontrun{write_bam(bam, index, "chr1:10001-100050", "subset.bam", min_mapq = 20, threads = 4)}
+//[[Rcpp::export]]
+int write_bam(std::string bam, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::string out,
+              int min_mapq = 0, int level = -1, bool write_index = true, int threads = 1) {
+    bool is_sam = out.size() >= 4 && out.compare(out.size() - 4, 4, ".sam") == 0;
+    if (write_index && is_sam) stop("only BAM output can be indexed while writing");
+    std::string mode = is_sam ? "w" : "wb";
+    if (level >= 0 && !is_sam) mode += std::to_string(std::min(level, 9));
+
+    BamCopy copy;
+    copy.fp = hts_open(bam.c_str(), "r");
+    if (!copy.fp) stop("couldn't read %s", bam);
+    copy.hdr = sam_hdr_read(copy.fp);
+    if (!copy.hdr) stop("couldn't read the header of %s", bam);
+    copy.itr = open_reads(copy.fp, copy.hdr, index, reg, threads);
+
+    copy.out_fp = hts_open(out.c_str(), mode.c_str());
+    if (!copy.out_fp) stop("couldn't write %s", out);
+    if (threads > 1) hts_set_threads(copy.out_fp, threads);
+    if (sam_hdr_write(copy.out_fp, copy.hdr) < 0) stop("couldn't write the header of %s", out);
+    std::string out_index = out + ".bai";
+    if (write_index && sam_idx_init(copy.out_fp, copy.hdr, 0, out_index.c_str()) < 0) {
+        stop("couldn't start an index for %s", out);
+    }
+
+    int n = 0;
+    int r = 0;
+    while((r = next_read(copy.fp, copy.hdr, copy.itr, copy.b)) >= 0) {
+        if (copy.b->core.qual < min_mapq) continue;
+        if (sam_write1(copy.out_fp, copy.hdr, copy.b) < 0) stop("couldn't write %s", out);
+        n++;
+    }
+    if (r < -1) stop("couldn't read %s", bam);
+    if (write_index && sam_idx_save(copy.out_fp) < 0) stop("couldn't write the index of %s", out);
+    // closing flushes the last BGZF block, so its result decides whether the file is complete
+    int closed = hts_close(copy.out_fp);
+    copy.out_fp = NULL;
+    if (closed < 0) stop("couldn't write %s", out);
+    Rprintf("wrote %d reads to %s\n", n, out.c_str());
+    return n;
+}
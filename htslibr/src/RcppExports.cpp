@@ -25,6 +25,18 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// idxstats
+DataFrame idxstats(std::string file, Nullable<CharacterVector> index);
+RcppExport SEXP _htslibr_idxstats(SEXP fileSEXP, SEXP indexSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    rcpp_result_gen = Rcpp::wrap(idxstats(file, index));
+    return rcpp_result_gen;
+END_RCPP
+}
 // extract_sequence
 CharacterVector extract_sequence(std::string bam, std::string index, std::string reg);
 RcppExport SEXP _htslibr_extract_sequence(SEXP bamSEXP, SEXP indexSEXP, SEXP regSEXP) {
@@ -39,29 +51,31 @@ BEGIN_RCPP
 END_RCPP
 }
 // count_kmer
-DataFrame count_kmer(std::string bam, std::string index, const std::string& reg, const std::string& kmer);
-RcppExport SEXP _htslibr_count_kmer(SEXP bamSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP kmerSEXP) {
+DataFrame count_kmer(std::string bam, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, const std::string& kmer, int threads);
+RcppExport SEXP _htslibr_count_kmer(SEXP bamSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP kmerSEXP, SEXP threadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< std::string >::type bam(bamSEXP);
-    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
-    Rcpp::traits::input_parameter< const std::string& >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
     Rcpp::traits::input_parameter< const std::string& >::type kmer(kmerSEXP);
-    rcpp_result_gen = Rcpp::wrap(count_kmer(bam, index, reg, kmer));
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(count_kmer(bam, index, reg, kmer, threads));
     return rcpp_result_gen;
 END_RCPP
 }
 // gc_content
-DataFrame gc_content(std::string bam, std::string index, const std::string& reg);
-RcppExport SEXP _htslibr_gc_content(SEXP bamSEXP, SEXP indexSEXP, SEXP regSEXP) {
+DataFrame gc_content(std::string bam, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, int threads);
+RcppExport SEXP _htslibr_gc_content(SEXP bamSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP threadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< std::string >::type bam(bamSEXP);
-    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
-    Rcpp::traits::input_parameter< const std::string& >::type reg(regSEXP);
-    rcpp_result_gen = Rcpp::wrap(gc_content(bam, index, reg));
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(gc_content(bam, index, reg, threads));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -78,30 +92,418 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// write_bam
+int write_bam(std::string bam, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::string out, int min_mapq, int level, bool write_index, int threads);
+RcppExport SEXP _htslibr_write_bam(SEXP bamSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP outSEXP, SEXP min_mapqSEXP, SEXP levelSEXP, SEXP write_indexSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type bam(bamSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< std::string >::type out(outSEXP);
+    Rcpp::traits::input_parameter< int >::type min_mapq(min_mapqSEXP);
+    Rcpp::traits::input_parameter< int >::type level(levelSEXP);
+    Rcpp::traits::input_parameter< bool >::type write_index(write_indexSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_bam(bam, index, reg, out, min_mapq, level, write_index, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// annotate_sites
+DataFrame annotate_sites(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::string intervals, bool count_only, int threads, std::string filter);
+RcppExport SEXP _htslibr_annotate_sites(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP intervalsSEXP, SEXP count_onlySEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< std::string >::type intervals(intervalsSEXP);
+    Rcpp::traits::input_parameter< bool >::type count_only(count_onlySEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(annotate_sites(vcf, index, reg, intervals, count_only, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
 // extract_info
-DataFrame extract_info(std::string vcf, std::string index, std::string& reg, std::string& tag);
-RcppExport SEXP _htslibr_extract_info(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP tagSEXP) {
+DataFrame extract_info(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::vector<std::string> tag, int threads, std::string filter);
+RcppExport SEXP _htslibr_extract_info(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP tagSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
-    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
-    Rcpp::traits::input_parameter< std::string& >::type reg(regSEXP);
-    Rcpp::traits::input_parameter< std::string& >::type tag(tagSEXP);
-    rcpp_result_gen = Rcpp::wrap(extract_info(vcf, index, reg, tag));
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type tag(tagSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(extract_info(vcf, index, reg, tag, threads, filter));
     return rcpp_result_gen;
 END_RCPP
 }
 // extract_genotypes
-SEXP extract_genotypes(std::string vcf, std::string index, std::string& reg);
-RcppExport SEXP _htslibr_extract_genotypes(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP) {
+SEXP extract_genotypes(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, int threads, Nullable<CharacterVector> samples, std::string filter, bool transpose);
+RcppExport SEXP _htslibr_extract_genotypes(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP threadsSEXP, SEXP samplesSEXP, SEXP filterSEXP, SEXP transposeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    Rcpp::traits::input_parameter< bool >::type transpose(transposeSEXP);
+    rcpp_result_gen = Rcpp::wrap(extract_genotypes(vcf, index, reg, threads, samples, filter, transpose));
+    return rcpp_result_gen;
+END_RCPP
+}
+// extract_info_regions
+DataFrame extract_info_regions(std::string vcf, std::string index, SEXP regions, std::vector<std::string> tag, int threads, std::string filter);
+RcppExport SEXP _htslibr_extract_info_regions(SEXP vcfSEXP, SEXP indexSEXP, SEXP regionsSEXP, SEXP tagSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type regions(regionsSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type tag(tagSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(extract_info_regions(vcf, index, regions, tag, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// extract_genotypes_regions
+List extract_genotypes_regions(std::string vcf, std::string index, SEXP regions, Nullable<CharacterVector> samples, int threads, std::string filter);
+RcppExport SEXP _htslibr_extract_genotypes_regions(SEXP vcfSEXP, SEXP indexSEXP, SEXP regionsSEXP, SEXP samplesSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type regions(regionsSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(extract_genotypes_regions(vcf, index, regions, samples, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// lookup_variants
+DataFrame lookup_variants(std::string vcf, std::string index, DataFrame keys, Nullable<CharacterVector> tag, int max_gap, int threads);
+RcppExport SEXP _htslibr_lookup_variants(SEXP vcfSEXP, SEXP indexSEXP, SEXP keysSEXP, SEXP tagSEXP, SEXP max_gapSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< DataFrame >::type keys(keysSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type tag(tagSEXP);
+    Rcpp::traits::input_parameter< int >::type max_gap(max_gapSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(lookup_variants(vcf, index, keys, tag, max_gap, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// extract_format
+List extract_format(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::string tag, Nullable<CharacterVector> samples, int threads, std::string filter);
+RcppExport SEXP _htslibr_extract_format(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP tagSEXP, SEXP samplesSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< std::string >::type tag(tagSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(extract_format(vcf, index, reg, tag, samples, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// score_test
+DataFrame score_test(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, NumericVector pheno, Nullable<NumericMatrix> covariates, std::string family, std::string tag, Nullable<CharacterVector> samples, int threads, std::string filter);
+RcppExport SEXP _htslibr_score_test(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP phenoSEXP, SEXP covariatesSEXP, SEXP familySEXP, SEXP tagSEXP, SEXP samplesSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type pheno(phenoSEXP);
+    Rcpp::traits::input_parameter< Nullable<NumericMatrix> >::type covariates(covariatesSEXP);
+    Rcpp::traits::input_parameter< std::string >::type family(familySEXP);
+    Rcpp::traits::input_parameter< std::string >::type tag(tagSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(score_test(vcf, index, reg, pheno, covariates, family, tag, samples, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// extract_dosage
+List extract_dosage(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::string tag, int bits, Nullable<CharacterVector> samples, int threads, std::string filter, Nullable<NumericVector> scale);
+RcppExport SEXP _htslibr_extract_dosage(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP tagSEXP, SEXP bitsSEXP, SEXP samplesSEXP, SEXP threadsSEXP, SEXP filterSEXP, SEXP scaleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< std::string >::type tag(tagSEXP);
+    Rcpp::traits::input_parameter< int >::type bits(bitsSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    Rcpp::traits::input_parameter< Nullable<NumericVector> >::type scale(scaleSEXP);
+    rcpp_result_gen = Rcpp::wrap(extract_dosage(vcf, index, reg, tag, bits, samples, threads, filter, scale));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dosage_matrix
+NumericVector dosage_matrix(List dosage, Nullable<IntegerVector> rows);
+RcppExport SEXP _htslibr_dosage_matrix(SEXP dosageSEXP, SEXP rowsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type dosage(dosageSEXP);
+    Rcpp::traits::input_parameter< Nullable<IntegerVector> >::type rows(rowsSEXP);
+    rcpp_result_gen = Rcpp::wrap(dosage_matrix(dosage, rows));
+    return rcpp_result_gen;
+END_RCPP
+}
+// build_id_index
+double build_id_index(std::string vcf, Nullable<CharacterVector> out);
+RcppExport SEXP _htslibr_build_id_index(SEXP vcfSEXP, SEXP outSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type out(outSEXP);
+    rcpp_result_gen = Rcpp::wrap(build_id_index(vcf, out));
+    return rcpp_result_gen;
+END_RCPP
+}
+// find_ids
+DataFrame find_ids(std::string vcf, std::vector<std::string> ids, Nullable<CharacterVector> index);
+RcppExport SEXP _htslibr_find_ids(SEXP vcfSEXP, SEXP idsSEXP, SEXP indexSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type ids(idsSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    rcpp_result_gen = Rcpp::wrap(find_ids(vcf, ids, index));
+    return rcpp_result_gen;
+END_RCPP
+}
+// ld_window
+List ld_window(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, int window, int max_dist, double min_r2, Nullable<CharacterVector> samples, int threads);
+RcppExport SEXP _htslibr_ld_window(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP windowSEXP, SEXP max_distSEXP, SEXP min_r2SEXP, SEXP samplesSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< int >::type window(windowSEXP);
+    Rcpp::traits::input_parameter< int >::type max_dist(max_distSEXP);
+    Rcpp::traits::input_parameter< double >::type min_r2(min_r2SEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(ld_window(vcf, index, reg, window, max_dist, min_r2, samples, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// grm
+NumericMatrix grm(std::string vcf, std::string index, std::vector<std::string> reg, int block_size, Nullable<CharacterVector> samples, int threads);
+RcppExport SEXP _htslibr_grm(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP block_sizeSEXP, SEXP samplesSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< int >::type block_size(block_sizeSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(grm(vcf, index, reg, block_size, samples, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// genotype_blocks
+SEXP genotype_blocks(std::string vcf, std::string index, std::vector<std::string> reg, int block_size, Nullable<CharacterVector> samples, int threads);
+RcppExport SEXP _htslibr_genotype_blocks(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP block_sizeSEXP, SEXP samplesSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< int >::type block_size(block_sizeSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(genotype_blocks(vcf, index, reg, block_size, samples, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// next_genotype_block
+SEXP next_genotype_block(SEXP blocks);
+RcppExport SEXP _htslibr_next_genotype_block(SEXP blocksSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type blocks(blocksSEXP);
+    rcpp_result_gen = Rcpp::wrap(next_genotype_block(blocks));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rewind_genotype_blocks
+void rewind_genotype_blocks(SEXP blocks);
+RcppExport SEXP _htslibr_rewind_genotype_blocks(SEXP blocksSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type blocks(blocksSEXP);
+    rewind_genotype_blocks(blocks);
+    return R_NilValue;
+END_RCPP
+}
+// genotype_matvec
+NumericMatrix genotype_matvec(std::string vcf, std::string index, std::vector<std::string> reg, NumericMatrix x, bool transpose, int block_size, Nullable<CharacterVector> samples, int threads);
+RcppExport SEXP _htslibr_genotype_matvec(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP xSEXP, SEXP transposeSEXP, SEXP block_sizeSEXP, SEXP samplesSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
+    Rcpp::traits::input_parameter< bool >::type transpose(transposeSEXP);
+    Rcpp::traits::input_parameter< int >::type block_size(block_sizeSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(genotype_matvec(vcf, index, reg, x, transpose, block_size, samples, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// extract_genotypes_sparse
+List extract_genotypes_sparse(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, double dense_af, Nullable<CharacterVector> samples, int threads, std::string filter);
+RcppExport SEXP _htslibr_extract_genotypes_sparse(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP dense_afSEXP, SEXP samplesSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< double >::type dense_af(dense_afSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(extract_genotypes_sparse(vcf, index, reg, dense_af, samples, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// variant_stats
+DataFrame variant_stats(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, Nullable<CharacterVector> samples, int threads, std::string filter);
+RcppExport SEXP _htslibr_variant_stats(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP samplesSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(variant_stats(vcf, index, reg, samples, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// sample_qc
+DataFrame sample_qc(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, Nullable<CharacterVector> samples, int threads, std::string filter);
+RcppExport SEXP _htslibr_sample_qc(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP samplesSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(sample_qc(vcf, index, reg, samples, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// window_stats
+DataFrame window_stats(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, int window, int threads, std::string filter);
+RcppExport SEXP _htslibr_window_stats(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP windowSEXP, SEXP threadsSEXP, SEXP filterSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< int >::type window(windowSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    rcpp_result_gen = Rcpp::wrap(window_stats(vcf, index, reg, window, threads, filter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// build_genotype_store
+void build_genotype_store(std::string vcf, std::string index, std::vector<std::string> reg, std::string store, Nullable<CharacterVector> info, Nullable<CharacterVector> samples, int threads);
+RcppExport SEXP _htslibr_build_genotype_store(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP storeSEXP, SEXP infoSEXP, SEXP samplesSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
     Rcpp::traits::input_parameter< std::string >::type index(indexSEXP);
-    Rcpp::traits::input_parameter< std::string& >::type reg(regSEXP);
-    rcpp_result_gen = Rcpp::wrap(extract_genotypes(vcf, index, reg));
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< std::string >::type store(storeSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type info(infoSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    build_genotype_store(vcf, index, reg, store, info, samples, threads);
+    return R_NilValue;
+END_RCPP
+}
+// join_vcfs
+List join_vcfs(std::vector<std::string> vcf, std::string reg, std::string pair, bool require_all, bool genotypes, Nullable<CharacterVector> info, int threads);
+RcppExport SEXP _htslibr_join_vcfs(SEXP vcfSEXP, SEXP regSEXP, SEXP pairSEXP, SEXP require_allSEXP, SEXP genotypesSEXP, SEXP infoSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< std::string >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< std::string >::type pair(pairSEXP);
+    Rcpp::traits::input_parameter< bool >::type require_all(require_allSEXP);
+    Rcpp::traits::input_parameter< bool >::type genotypes(genotypesSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type info(infoSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(join_vcfs(vcf, reg, pair, require_all, genotypes, info, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// write_vcf
+int write_vcf(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::string out, Nullable<CharacterVector> samples, std::string filter, int level, Nullable<LogicalVector> write_index, int threads);
+RcppExport SEXP _htslibr_write_vcf(SEXP vcfSEXP, SEXP indexSEXP, SEXP regSEXP, SEXP outSEXP, SEXP samplesSEXP, SEXP filterSEXP, SEXP levelSEXP, SEXP write_indexSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type vcf(vcfSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type reg(regSEXP);
+    Rcpp::traits::input_parameter< std::string >::type out(outSEXP);
+    Rcpp::traits::input_parameter< Nullable<CharacterVector> >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< std::string >::type filter(filterSEXP);
+    Rcpp::traits::input_parameter< int >::type level(levelSEXP);
+    Rcpp::traits::input_parameter< Nullable<LogicalVector> >::type write_index(write_indexSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_vcf(vcf, index, reg, out, samples, filter, level, write_index, threads));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -109,12 +511,37 @@ END_RCPP
 static const R_CallMethodDef CallEntries[] = {
     {"_htslibr_htslib_version", (DL_FUNC) &_htslibr_htslib_version, 0},
     {"_htslibr_check_format", (DL_FUNC) &_htslibr_check_format, 1},
+    {"_htslibr_idxstats", (DL_FUNC) &_htslibr_idxstats, 2},
     {"_htslibr_extract_sequence", (DL_FUNC) &_htslibr_extract_sequence, 3},
-    {"_htslibr_count_kmer", (DL_FUNC) &_htslibr_count_kmer, 4},
-    {"_htslibr_gc_content", (DL_FUNC) &_htslibr_gc_content, 3},
+    {"_htslibr_count_kmer", (DL_FUNC) &_htslibr_count_kmer, 5},
+    {"_htslibr_gc_content", (DL_FUNC) &_htslibr_gc_content, 4},
     {"_htslibr_depth", (DL_FUNC) &_htslibr_depth, 3},
-    {"_htslibr_extract_info", (DL_FUNC) &_htslibr_extract_info, 4},
-    {"_htslibr_extract_genotypes", (DL_FUNC) &_htslibr_extract_genotypes, 3},
+    {"_htslibr_write_bam", (DL_FUNC) &_htslibr_write_bam, 8},
+    {"_htslibr_annotate_sites", (DL_FUNC) &_htslibr_annotate_sites, 7},
+    {"_htslibr_extract_info", (DL_FUNC) &_htslibr_extract_info, 6},
+    {"_htslibr_extract_genotypes", (DL_FUNC) &_htslibr_extract_genotypes, 7},
+    {"_htslibr_extract_info_regions", (DL_FUNC) &_htslibr_extract_info_regions, 6},
+    {"_htslibr_extract_genotypes_regions", (DL_FUNC) &_htslibr_extract_genotypes_regions, 6},
+    {"_htslibr_lookup_variants", (DL_FUNC) &_htslibr_lookup_variants, 6},
+    {"_htslibr_extract_format", (DL_FUNC) &_htslibr_extract_format, 7},
+    {"_htslibr_score_test", (DL_FUNC) &_htslibr_score_test, 10},
+    {"_htslibr_extract_dosage", (DL_FUNC) &_htslibr_extract_dosage, 9},
+    {"_htslibr_dosage_matrix", (DL_FUNC) &_htslibr_dosage_matrix, 2},
+    {"_htslibr_build_id_index", (DL_FUNC) &_htslibr_build_id_index, 2},
+    {"_htslibr_find_ids", (DL_FUNC) &_htslibr_find_ids, 3},
+    {"_htslibr_ld_window", (DL_FUNC) &_htslibr_ld_window, 8},
+    {"_htslibr_grm", (DL_FUNC) &_htslibr_grm, 6},
+    {"_htslibr_genotype_blocks", (DL_FUNC) &_htslibr_genotype_blocks, 6},
+    {"_htslibr_next_genotype_block", (DL_FUNC) &_htslibr_next_genotype_block, 1},
+    {"_htslibr_rewind_genotype_blocks", (DL_FUNC) &_htslibr_rewind_genotype_blocks, 1},
+    {"_htslibr_genotype_matvec", (DL_FUNC) &_htslibr_genotype_matvec, 8},
+    {"_htslibr_extract_genotypes_sparse", (DL_FUNC) &_htslibr_extract_genotypes_sparse, 7},
+    {"_htslibr_variant_stats", (DL_FUNC) &_htslibr_variant_stats, 6},
+    {"_htslibr_sample_qc", (DL_FUNC) &_htslibr_sample_qc, 6},
+    {"_htslibr_window_stats", (DL_FUNC) &_htslibr_window_stats, 6},
+    {"_htslibr_build_genotype_store", (DL_FUNC) &_htslibr_build_genotype_store, 7},
+    {"_htslibr_join_vcfs", (DL_FUNC) &_htslibr_join_vcfs, 7},
+    {"_htslibr_write_vcf", (DL_FUNC) &_htslibr_write_vcf, 9},
     {NULL, NULL, 0}
 };
 
@@ -1,273 +1,1195 @@
 #include<Rcpp.h>
+#include <cctype>
+#include <cstring>
+#include <unordered_map>
 #include "htslib/hts.h"
 #include "htslib/vcf.h"
 #include "htslib/tbx.h"
+#include "htslib/khash.h"
+#include "vcf_reader.h"
+#include "vcf_store.h"
 using namespace Rcpp;
 using namespace std;
 
-//' extract values from the INFO field
-//' @param vcf the VCF/BCF file path
-//' @param index the CSI/TBI index file path
-//' @param reg a region query of the form: chr:start-end 
-//' @param tag the field in the INFO field to extract. Only accepts one string value at this time. Only can extract numeric fields at the moment. 
-//' @description Use this function to extract the INFO field values for a single INFO field in a give
-//' region based query. 
-//' @return a dataframe with the chrom, pos, and value of the given INFO field
-//' @examples
-//' \dontrun{extract_info(vcf, index, "1:10001-100500", "AC")}
-// [[Rcpp::export]]
-DataFrame extract_info(std::string vcf, std::string index, std::string& reg, std::string &tag) {
-    htsFile *fp = hts_open(vcf.c_str(), "r");
-    if (!fp) REprintf("couldn't read vcf %s", vcf);
-    const htsFormat* fmt = &fp->format;
-    char* description = hts_format_description(fmt);
-    std::string format(description);
-    Rcout << "detecting format " << format << endl;
-    bool use_csi = false;
-    if (index.find("csi") != std::string::npos) {
-        use_csi = true;
-        Rcout << "using csi index" << endl;
-    }
-    hts_idx_t *csi_idx;
-    tbx_t *tbi_idx;
-    if (use_csi) {
-         csi_idx = bcf_index_load2(vcf.c_str(), index.c_str());
-        if(!csi_idx) {
-            stop("csi index is null");
+KHASH_MAP_INIT_STR(str2code, int)
+
+// interns the distinct values of a string column, numbering them in order of
+// first appearance. Annotation strings repeat heavily, so a shard keeps one
+// copy of each value and an int per record.
+class StringPool {
+public:
+    StringPool() : map(kh_init(str2code)) {}
+    StringPool(const StringPool& other) : map(kh_init(str2code)) {
+        for (size_t i = 0; i < other.levels.size(); i++) intern(other.levels[i], strlen(other.levels[i]));
+    }
+    ~StringPool() {
+        kh_destroy(str2code, map);
+        for (size_t i = 0; i < levels.size(); i++) free(levels[i]);
+    }
+
+    int intern(const char *p, size_t len) {
+        key.assign(p, len); // khash needs a NUL-terminated key, BCF strings aren't
+        khiter_t k = kh_get(str2code, map, key.c_str());
+        if (k != kh_end(map)) return kh_val(map, k);
+        char *copy = strdup(key.c_str());
+        int ret;
+        k = kh_put(str2code, map, copy, &ret);
+        kh_val(map, k) = levels.size();
+        levels.push_back(copy);
+        return kh_val(map, k);
+    }
+
+    std::vector<char*> levels;
+
+private:
+    StringPool& operator=(const StringPool&);
+
+    khash_t(str2code) *map;
+    std::string key;
+};
+
+enum InfoKind { INFO_FLAG, INFO_INT, INFO_REAL, INFO_STR };
+
+// an INFO tag resolved against the header once, before the scan
+struct InfoField {
+    std::string tag;
+    int id;
+    int kind;
+    bool is_list; // Number=A/R/G/. or Number>1: one vector per record
+};
+
+// values for one INFO field across a shard. Scalars hold one value per
+// record; list columns also record where each record's values end.
+struct InfoColumn {
+    std::vector<int> ints;
+    std::vector<double> reals;
+    std::vector<int> codes; // into pool, -1 when missing
+    StringPool pool;
+    std::vector<size_t> ends;
+};
+
+// decode a BCF-typed INFO vector, mapping missing values to NA
+template <class T>
+static void append_info_values(const bcf_info_t *info, std::vector<T>& out, T na, bool first_only) {
+    int n = first_only && info->len > 1 ? 1 : info->len;
+    #define BRANCH(type_t, is_missing, is_vector_end) { \
+        type_t *p = (type_t *) info->vptr; \
+        for (int i = 0; i < n; i++) { \
+            if (is_vector_end) break; \
+            out.push_back(is_missing ? na : (T) p[i]); \
+        } \
+    }
+    switch (info->type) {
+        case BCF_BT_INT8:  BRANCH(int8_t,  p[i]==bcf_int8_missing,  p[i]==bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, p[i]==bcf_int16_missing, p[i]==bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, p[i]==bcf_int32_missing, p[i]==bcf_int32_vector_end); break;
+        case BCF_BT_FLOAT: BRANCH(float,   bcf_float_is_missing(p[i]), bcf_float_is_vector_end(p[i])); break;
+    }
+    #undef BRANCH
+}
+
+class InfoKernel : public VcfKernel {
+public:
+    InfoKernel(const std::vector<InfoField>& fields, int n_ids)
+        : fields(fields), columns(fields.size()), col_of_id(n_ids, -1), seen(fields.size()) {
+        for (size_t c = 0; c < fields.size(); c++) col_of_id[fields[c].id] = c;
+    }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        bcf_unpack(line, BCF_UN_INFO);
+        rids.push_back(line->rid);
+        positions.push_back(line->pos);
+
+        // one walk over the record's INFO fields fills every requested column
+        std::fill(seen.begin(), seen.end(), 0);
+        for (int i = 0; i < line->n_info; i++) {
+            bcf_info_t *info = &line->d.info[i];
+            if (!info->vptr || info->key >= (int) col_of_id.size()) continue;
+            int c = col_of_id[info->key];
+            if (c < 0 || seen[c]) continue;
+            seen[c] = 1;
+            append(fields[c], columns[c], info);
         }
-    } else {
-        tbi_idx = tbx_index_load2(vcf.c_str(), index.c_str());
-        if(!tbi_idx) {
-            stop("tbi index is null");
+        for (size_t c = 0; c < fields.size(); c++) {
+            if (!seen[c]) append(fields[c], columns[c], NULL);
+            if (fields[c].is_list) {
+                columns[c].ends.push_back(fields[c].kind == INFO_INT ? columns[c].ints.size() : columns[c].reals.size());
+            }
+        }
+        return true;
+    }
+
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        rids.reserve(n_records);
+        positions.reserve(n_records);
+        for (size_t c = 0; c < fields.size(); c++) {
+            InfoColumn& column = columns[c];
+            if (fields[c].is_list) {
+                column.ends.reserve(n_records);
+            } else if (fields[c].kind == INFO_STR) {
+                column.codes.reserve(n_records);
+            } else if (fields[c].kind == INFO_REAL) {
+                column.reals.reserve(n_records);
+            } else {
+                column.ints.reserve(n_records);
+            }
         }
     }
 
-    bcf_hdr_t *hdr = bcf_hdr_read(fp);
-    if (!hdr) REprintf("can't reader header for vcf %s", vcf);
-    bcf1_t *line = bcf_init();
+    std::vector<InfoField> fields;
+    std::vector<InfoColumn> columns;
+    std::vector<int> rids;
+    std::vector<int> positions;
 
-    hts_itr_t *itr;
-    if (use_csi) {
-        itr = bcf_itr_querys(csi_idx, hdr, reg.c_str());
-    } else {
-        itr = tbx_itr_querys(tbi_idx, reg.c_str());
-        if(!itr) stop("itr is null");
+private:
+    // info is NULL when the record doesn't carry the field
+    static void append(const InfoField& field, InfoColumn& column, const bcf_info_t *info) {
+        size_t before;
+        switch (field.kind) {
+            case INFO_FLAG:
+                column.ints.push_back(info != NULL);
+                break;
+            case INFO_INT:
+                before = column.ints.size();
+                if (info) append_info_values<int>(info, column.ints, NA_INTEGER, !field.is_list);
+                if (column.ints.size() == before) column.ints.push_back(NA_INTEGER);
+                break;
+            case INFO_REAL:
+                before = column.reals.size();
+                if (info) append_info_values<double>(info, column.reals, NA_REAL, !field.is_list);
+                if (column.reals.size() == before) column.reals.push_back(NA_REAL);
+                break;
+            case INFO_STR:
+                if (info) {
+                    const char *p = (const char *) info->vptr;
+                    int len = info->len;
+                    while (len > 0 && p[len - 1] == '\0') len--; // BCF pads strings with NULs
+                    column.codes.push_back(column.pool.intern(p, len));
+                } else {
+                    column.codes.push_back(-1);
+                }
+                break;
+        }
     }
-    int r;
-    int ret;
-    kstring_t s = {0, 0, NULL}; // needs to be initialized to prevent segfault    
-    bcf_info_t *info;
 
-    // report chrom and position
-    CharacterVector chroms;
-    IntegerVector positions;
-
-    // don't know what type the INFO field 'tag' will have so we initialize three possible types
-    IntegerVector int_res;
-    NumericVector num_res;
-    CharacterVector char_res;
-    bool is_int = false;
-    bool is_float = false;
-    bool is_string = false;
-
-    if (use_csi) {
-        // TODO: refactor so there is less repeated code
-        while((r = bcf_itr_next(fp, itr, line)) >= 0) {
-
-            chroms.push_back(bcf_hdr_id2name(hdr, line->rid));
-            positions.push_back(line->pos);
-
-            info = bcf_get_info(hdr, line, tag.c_str());
-            if (info == nullptr) stop("info field does not exist");
-
-            if (info->len == 1) {
-                    // see here as a reference https://github.com/brentp/cyvcf2/blob/master/cyvcf2/cyvcf2.pyx#L2003
-                if (info->type == BCF_BT_INT8 || info->type == BCF_BT_INT16 || info->type == BCF_BT_INT32) {
-                    int_res.push_back(info->v1.i); 
-                    is_int = true;
-                } else if(info->type == BCF_BT_FLOAT) {
-                    // num_res.push_back(bcf_float_is_missing(info->v1.f)); // appears to convert values to 0
-                    num_res.push_back(info->v1.f);
-                    is_float = true;
+    std::vector<int> col_of_id;
+    std::vector<char> seen;
+};
+
+class GenotypeKernel : public VcfKernel {
+public:
+    GenotypeKernel() : num_variants(0), gt_arr(NULL), ngt_arr(0) {}
+    GenotypeKernel(const GenotypeKernel& other) : num_variants(0), gt_arr(NULL), ngt_arr(0) {}
+    ~GenotypeKernel() { free(gt_arr); }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        size_t at = genotypes.size();
+        genotypes.resize(at + 2 * bcf_hdr_nsamples(hdr));
+        if (!decode(hdr, line, genotypes.empty() ? NULL : &genotypes[at])) return false;
+        num_variants++;
+        return true;
+    }
+
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        genotypes.reserve(n_records * 2 * bcf_hdr_nsamples(hdr));
+    }
+
+    std::vector<int> genotypes;
+    int num_variants;
+
+protected:
+    // the two allele indices of every sample into out
+    bool decode(bcf_hdr_t *hdr, bcf1_t *line, int *out) {
+        int n_samples = bcf_hdr_nsamples(hdr);
+
+        // https://github.com/samtools/htslib/blob/2da4c7dd951428fa9d0d4049394045d1cace4133/htslib/vcf.h#L790
+        int ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
+        int max_ploidy = ngt / n_samples;
+        if (max_ploidy != 2) {
+            error = "currently only support for diploid organisms";
+            return false;
+        }
+
+        for (int i = 0; i < n_samples; i++) {
+            int32_t *ptr = gt_arr + i * max_ploidy; // pointer to ith individual's genotypes
+
+            for (int j = 0; j < max_ploidy; j++) {
+
+                if ( ptr[j]==bcf_int32_vector_end ) {
+                    error = "currently only support for diploid organisms";
+                    return false;
+                }
+
+                if ( bcf_gt_is_missing(ptr[j]) ) {
+                    error = "missing value support not yet added";
+                    return false;
                 }
+
+                *out++ = bcf_gt_allele(ptr[j]);
             }
         }
-    } else {
-        while((r = tbx_itr_next(fp, tbi_idx, itr, &s)) >= 0) {
+        return true;
+    }
+
+private:
+    int32_t *gt_arr;
+    int ngt_arr;
+};
+
+// counts the records of a shard, to size a result before it is filled
+class CountKernel : public VcfKernel {
+public:
+    CountKernel() : n(0) {}
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        n++;
+        return true;
+    }
+    size_t n;
+};
 
-            ret = vcf_parse(&s, hdr, line);
-            if(ret > 0) stop("vcf parsing error");
+// writes a shard's genotypes straight into rows [row0, row0 + n_rows) of the
+// variants x haplotypes result, 64 variants at a time: a tile is decoded
+// row-major into scratch and then transposed into place
+class TransposedGenotypeKernel : public GenotypeKernel {
+public:
+    TransposedGenotypeKernel() : out(NULL), out_rows(0), row0(0), n_rows(0), n_haps(0), filled(0) {}
+    TransposedGenotypeKernel(const TransposedGenotypeKernel& other)
+        : GenotypeKernel(other), out(other.out), out_rows(other.out_rows), row0(other.row0), n_rows(other.n_rows),
+          n_haps(other.n_haps), filled(0) {}
 
-            chroms.push_back(bcf_hdr_id2name(hdr, line->rid));
-            positions.push_back(line->pos);
+    void place(int *result, size_t result_rows, size_t first_row, size_t rows, size_t haps) {
+        out = result;
+        out_rows = result_rows;
+        row0 = first_row;
+        n_rows = rows;
+        n_haps = haps;
+        scratch.resize(tile * n_haps);
+    }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        if ((size_t) num_variants >= n_rows) {
+            error = "the region has more records than when it was counted; was the file changed?";
+            return false;
+        }
+        if (!decode(hdr, line, scratch.empty() ? NULL : &scratch[filled * n_haps])) return false;
+        num_variants++;
+        if (++filled == tile) flush();
+        return true;
+    }
+
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {} // the result is allocated by the caller
+
+    // write out a partly filled last tile; call once the scan is done
+    void flush() {
+        if (filled && n_haps) transpose_tiled(&scratch[0], filled, n_haps, out, out_rows, row0 + num_variants - filled);
+        filled = 0;
+    }
+
+private:
+    static const size_t tile = 64;
+    int *out;
+    size_t out_rows;
+    size_t row0;
+    size_t n_rows;
+    size_t n_haps;
+    size_t filled;
+    std::vector<int> scratch;
+};
+
+// counts the records of a shard and, for fields with more than one value, the
+// most values any record has per sample, to size extract_format's result
+class FormatCountKernel : public CountKernel {
+public:
+    FormatCountKernel(const std::string& tag, bool need_width) : tag(tag), need_width(need_width), depth(1) {}
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        n++;
+        if (need_width) {
+            bcf_fmt_t *fmt = bcf_get_fmt(hdr, line, tag.c_str());
+            if (fmt) depth = std::max(depth, fmt->n);
+        }
+        return true;
+    }
+    std::string tag;
+    bool need_width;
+    int depth;
+};
+
+static inline bool format_vector_end(int32_t x) { return x == bcf_int32_vector_end; }
+static inline bool format_vector_end(float x) { return bcf_float_is_vector_end(x); }
+static inline bool format_missing(int32_t x) { return x == bcf_int32_missing; }
+static inline bool format_missing(float x) { return bcf_float_is_missing(x); }
+
+// copies one record's values (width per sample) into row `row` of a column-major
+// rows x samples x depth result; missing values and padding are left as they are
+template <class In, class Out>
+static void place_format_values(const In *src, int width, int depth, Out *out, size_t row, size_t rows,
+                                size_t n_samples) {
+    int keep = std::min(width, depth);
+    for (size_t j = 0; j < n_samples; j++) {
+        for (int d = 0; d < keep; d++) {
+            In x = src[j * width + d];
+            if (format_vector_end(x)) break;
+            if (!format_missing(x)) out[row + rows * (j + n_samples * d)] = x;
+        }
+    }
+}
+
+// once placed, writes a shard's values straight into rows [row0, row0 + n_rows)
+// of the NA-filled result; otherwise they are buffered in ints/floats
+class FormatKernel : public VcfKernel {
+public:
+    FormatKernel(const std::string& tag, bool is_int)
+        : tag(tag), is_int(is_int), int_out(NULL), real_out(NULL), out_rows(0), row0(0), n_rows(0), depth(0),
+          buf(NULL), nbuf(0) {}
+    FormatKernel(const FormatKernel& other)
+        : tag(other.tag), is_int(other.is_int), int_out(other.int_out), real_out(other.real_out),
+          out_rows(other.out_rows), row0(other.row0), n_rows(other.n_rows), depth(other.depth), buf(NULL), nbuf(0) {}
+    ~FormatKernel() { free(buf); }
+
+    void place(int *ints_result, double *reals_result, size_t result_rows, size_t first_row, size_t rows,
+               int result_depth) {
+        int_out = ints_result;
+        real_out = reals_result;
+        out_rows = result_rows;
+        row0 = first_row;
+        n_rows = rows;
+        depth = result_depth;
+    }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        bool placed = int_out || real_out;
+        if (placed && rids.size() >= n_rows) {
+            error = "the region has more records than when it was counted; was the file changed?";
+            return false;
+        }
+        // the decode buffer is reused across records; sentinels are translated as
+        // the values are placed
+        int n = is_int ? bcf_get_format_int32(hdr, line, tag.c_str(), &buf, &nbuf)
+                       : bcf_get_format_float(hdr, line, tag.c_str(), &buf, &nbuf);
+        if (n == -3) {
+            n = 0; // the record doesn't carry this field
+        } else if (n < 0) {
+            error = "couldn't read format field " + tag;
+            return false;
+        }
+        int n_samples = bcf_hdr_nsamples(hdr);
+        int width = n_samples ? n / n_samples : 0;
+        if (placed) {
+            size_t row = row0 + rids.size();
+            if (int_out) {
+                place_format_values((int32_t *) buf, width, depth, int_out, row, out_rows, n_samples);
+            } else {
+                place_format_values((float *) buf, width, depth, real_out, row, out_rows, n_samples);
+            }
+        } else {
+            widths.push_back(width);
+            if (is_int) {
+                ints.insert(ints.end(), (int32_t *) buf, (int32_t *) buf + n);
+            } else {
+                floats.insert(floats.end(), (float *) buf, (float *) buf + n);
+            }
+        }
+        rids.push_back(line->rid);
+        positions.push_back(line->pos);
+        return true;
+    }
+
+    // placed kernels are sized from the count; buffered values are sized for one
+    // value per sample, and Number>1 fields grow from there
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        if (int_out || real_out) n_records = n_rows;
+        rids.reserve(n_records);
+        positions.reserve(n_records);
+        if (int_out || real_out) return;
+        widths.reserve(n_records);
+        if (is_int) {
+            ints.reserve(n_records * bcf_hdr_nsamples(hdr));
+        } else {
+            floats.reserve(n_records * bcf_hdr_nsamples(hdr));
+        }
+    }
 
-            info = bcf_get_info(hdr, line, tag.c_str());
-            if (info == nullptr) stop("info field does not exist");
+    std::string tag;
+    bool is_int;
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<int> widths;
+    std::vector<int32_t> ints;
+    std::vector<float> floats;
 
-            if (info->len == 1) {
-                if (info->type == BCF_BT_INT8 || info->type == BCF_BT_INT16 || info->type == BCF_BT_INT32) {
-                    int_res.push_back(info->v1.i); 
-                    is_int = true; // need this for the final return type
-                } else if(info->type == BCF_BT_FLOAT) {
-                    // num_res.push_back(bcf_float_is_missing(info->v1.f)); // appears to convert values to 0
-                    num_res.push_back(info->v1.f);
-                    is_float = true;
+private:
+    int *int_out;
+    double *real_out;
+    size_t out_rows;
+    size_t row0;
+    size_t n_rows;
+    int depth;
+    void *buf;
+    int nbuf;
+};
+
+static SEXP collect_info_column(const InfoField& field, std::vector<InfoKernel>& kernels, size_t c, size_t n) {
+    size_t row = 0;
+    if (field.is_list) {
+        List out(n);
+        for (size_t k = 0; k < kernels.size(); k++) {
+            const InfoColumn& column = kernels[k].columns[c];
+            size_t start = 0;
+            for (size_t i = 0; i < column.ends.size(); i++, row++) {
+                if (field.kind == INFO_INT) {
+                    out[row] = IntegerVector(column.ints.begin() + start, column.ints.begin() + column.ends[i]);
+                } else {
+                    out[row] = NumericVector(column.reals.begin() + start, column.reals.begin() + column.ends[i]);
                 }
+                start = column.ends[i];
             }
         }
+        return out;
     }
+    if (field.kind == INFO_STR) {
+        // merge the shards' pools into one set of levels, still in order of first appearance,
+        // so only the distinct values ever become R strings
+        khash_t(str2code) *global = kh_init(str2code);
+        std::vector<const char*> levels;
+        std::vector<int> remap;
+        IntegerVector out(n);
+        for (size_t k = 0; k < kernels.size(); k++) {
+            const InfoColumn& column = kernels[k].columns[c];
+            remap.resize(column.pool.levels.size());
+            for (size_t l = 0; l < column.pool.levels.size(); l++) {
+                int ret;
+                khiter_t it = kh_put(str2code, global, column.pool.levels[l], &ret);
+                if (ret > 0) {
+                    kh_val(global, it) = levels.size();
+                    levels.push_back(column.pool.levels[l]);
+                }
+                remap[l] = kh_val(global, it);
+            }
+            for (size_t i = 0; i < column.codes.size(); i++, row++) {
+                out[row] = column.codes[i] < 0 ? NA_INTEGER : remap[column.codes[i]] + 1;
+            }
+        }
+        kh_destroy(str2code, global);
 
-    free(s.s);
+        CharacterVector level_names(levels.size());
+        for (size_t l = 0; l < levels.size(); l++) level_names[l] = levels[l];
+        out.attr("levels") = level_names;
+        out.attr("class") = "factor";
+        return out;
+    }
+    if (field.kind == INFO_REAL) {
+        NumericVector out(n);
+        for (size_t k = 0; k < kernels.size(); k++) {
+            const std::vector<double>& reals = kernels[k].columns[c].reals;
+            std::copy(reals.begin(), reals.end(), out.begin() + row);
+            row += reals.size();
+        }
+        return out;
+    }
+    // INFO_INT and INFO_FLAG
+    IntegerVector out(n);
+    for (size_t k = 0; k < kernels.size(); k++) {
+        const std::vector<int>& ints = kernels[k].columns[c].ints;
+        std::copy(ints.begin(), ints.end(), out.begin() + row);
+        row += ints.size();
+    }
+    if (field.kind == INFO_FLAG) return LogicalVector(out);
+    return out;
+}
 
-    bcf_destroy(line);
-    hts_close(fp);
+static std::vector<InfoField> resolve_info_fields(bcf_hdr_t *hdr, const std::vector<std::string>& tag) {
+    std::vector<InfoField> fields;
+    for (size_t t = 0; t < tag.size(); t++) {
+        int id = bcf_hdr_id2int(hdr, BCF_DT_ID, tag[t].c_str());
+        if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id)) stop("info field %s does not exist", tag[t]);
 
-    if (is_int) {
-        return DataFrame::create(
-            Named("chrom") = chroms,
-            Named("pos") = positions,
-            Named("value") = int_res
-        );
-    } else if(is_float) {
-        return DataFrame::create(
-            Named("chrom") = chroms,
-            Named("pos") = positions,
-            Named("value") = num_res
-        );
-    } else {
-        return DataFrame::create(
-            Named("chrom") = chroms,
-            Named("pos") = positions,
-            Named("value") = char_res
-        );
+        InfoField field = {tag[t], id, INFO_STR, false};
+        switch (bcf_hdr_id2type(hdr, BCF_HL_INFO, id)) {
+            case BCF_HT_FLAG: field.kind = INFO_FLAG; break;
+            case BCF_HT_INT:  field.kind = INFO_INT; break;
+            case BCF_HT_REAL: field.kind = INFO_REAL; break;
+        }
+        if (field.kind == INFO_INT || field.kind == INFO_REAL) {
+            field.is_list = bcf_hdr_id2length(hdr, BCF_HL_INFO, id) != BCF_VL_FIXED ||
+                            bcf_hdr_id2number(hdr, BCF_HL_INFO, id) != 1;
+        }
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+// the chrom, pos and per-tag columns of the records the kernels saw; returns the number of rows
+static size_t info_columns(bcf_hdr_t *hdr, const std::vector<InfoField>& fields, std::vector<InfoKernel>& kernels,
+                           List& columns, CharacterVector& names) {
+    size_t n = 0;
+    for (size_t k = 0; k < kernels.size(); k++) n += kernels[k].rids.size();
+
+    // report chrom and position
+    CharacterVector chroms(n);
+    IntegerVector positions(n);
+
+    // shards are in genomic order, so concatenating them keeps the records sorted
+    size_t row = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        for (size_t i = 0; i < kernels[k].rids.size(); i++, row++) {
+            chroms[row] = bcf_hdr_id2name(hdr, kernels[k].rids[i]);
+            positions[row] = kernels[k].positions[i];
+        }
+    }
+
+    columns = List(2 + fields.size());
+    names = CharacterVector(2 + fields.size());
+    columns[0] = chroms;
+    names[0] = "chrom";
+    columns[1] = positions;
+    names[1] = "pos";
+    for (size_t c = 0; c < fields.size(); c++) {
+        columns[2 + c] = collect_info_column(fields[c], kernels, c, n);
+        names[2 + c] = fields[c].tag;
+    }
+    return n;
+}
+
+//' extract values from the INFO field
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param tag a character vector of INFO fields to extract. Integer and Float fields with Number=1
+//' become numeric columns, Flag fields logical columns and String fields factor columns. Integer
+//' and Float fields with any other Number (A, R, G, . or more than one) become list columns holding one
+//' vector per record. Records missing a field get NA (FALSE for flags).
+//' @param threads the number of threads. The region is split into this many shards, aligned to the
+//' index's linear windows, which are read concurrently with one file handle each.
+//' @param filter an optional site filter expression over QUAL, POS, N_ALT, FILTER and INFO fields, e.g.
+//' 'FILTER == "PASS" && QUAL > 30 && AF >= 0.01 && AF <= 0.99'. Sites failing it are dropped before their
+//' FORMAT fields are decoded.
+//' @description Use this function to extract the INFO field values for one or more INFO fields in a give
+//' region based query. The tags are resolved against the header once and all of them are
+//' filled in a single pass over the records.
+//' @details String values are interned in a hash table while the records are read, so a column of repetitive
+//' annotations costs one integer per record plus one copy of each distinct value. Their factor levels are in
+//' order of first appearance, not sorted; use as.character() to get a character column.
+//'
+//' vcf may also be a store directory written by build_genotype_store, in which case index and
+//' threads are ignored and tag must be among the INFO fields stored.
+//' @return a dataframe with the chrom and pos of each record, and one column per INFO field named after the tag
+//' @examples
+//' \dontrun{extract_info(vcf, index, "1:10001-100500", c("AC", "AF", "DB"))}
+// [[Rcpp::export]]
+DataFrame extract_info(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                       std::vector<std::string> tag, int threads = 1, std::string filter = "") {
+    std::string region = optional_string(reg);
+    if (GenotypeStore::is_store(vcf)) {
+        if (!filter.empty()) stop("filter is not supported on a genotype store");
+        return store_extract_info(vcf, region, tag);
     }
 
-    stop("not yet implemented"); // this happens if the INFO field is a string
+    VcfSource source = {vcf, optional_string(index)};
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    bcf_hdr_t *hdr = reader.hdr;
+    std::vector<InfoField> fields = resolve_info_fields(hdr, tag);
+
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    std::vector<InfoKernel> kernels(shards.size(), InfoKernel(fields, hdr->n[BCF_DT_ID]));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    List columns;
+    CharacterVector names;
+    size_t n = info_columns(hdr, fields, kernels, columns, names);
+    return make_data_frame(columns, names, n);
 }
 
 //' extract the genotypes for a given region from the GT field
 //' @param vcf the VCF/BCF file path
-//' @param index the CSI/TBI index file path
-//' @param reg a region query of the form: chr:start-end 
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param threads the number of threads. The region is split into this many shards, aligned to the
+//' index's linear windows, which are read concurrently with one file handle each.
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param filter an optional site filter expression over QUAL, POS, N_ALT, FILTER and INFO fields, e.g.
+//' 'FILTER == "PASS" && QUAL > 30 && AF >= 0.01 && AF <= 0.99'. Sites failing it are dropped before their
+//' FORMAT fields are decoded.
+//' @param transpose return a variants x haplotypes matrix instead, so the calls of each haplotype are
+//' contiguous. The records are counted in a first pass so the result can be allocated up front, and each shard
+//' then writes its calls into it in 64 x 64 tiles as it reads them, so memory use stays at about one copy of the
+//' matrix rather than the two that t() needs. A VCF that isn't bgzipped (plain text or plain gzip) can't be read
+//' twice and so can't be transposed.
 //' @description Use this function to extract the genotypes from the GT field. Will return as a 
 //' IntegerMatrix of dimensions haplotypes x variants. That is, each (diploid) individual will have two consecutve rows.
 //' No existing support for using the phase of the genotypes (if present) or for handling missing values or
 //' variable ploidy. 
-//' @return a integer matrix of dimension (number of haplotypes x number of variants).
+//' @details vcf may also be a store directory written by build_genotype_store, in which case index is ignored
+//' and the genotypes are decoded straight from the memory-mapped store.
+//' @return a integer matrix of dimension (number of haplotypes x number of variants), or (number of variants x
+//' number of haplotypes) when transpose is TRUE.
 //' @examples
 //' \dontrun{extract_genotypes(vcf, index, "1:10001-100500")}
 // [[Rcpp::export]]
-SEXP extract_genotypes(std::string vcf, std::string index, std::string& reg) {
-    htsFile *fp = hts_open(vcf.c_str(), "r");
-    if (!fp) REprintf("couldn't read vcf %s", vcf);
-    const htsFormat* fmt = &fp->format;
-    char* description = hts_format_description(fmt);
-    std::string format(description);
-    Rcout << "detecting format " << format << endl;
-    bool use_csi = false;
-    if (index.find("csi") != std::string::npos) {
-        use_csi = true;
-        Rcout << "using csi index" << endl;
-    }
-    hts_idx_t *csi_idx;
-    tbx_t *tbi_idx;
-    if (use_csi) {
-         csi_idx = bcf_index_load2(vcf.c_str(), index.c_str());
-        if(!csi_idx) {
-            stop("csi index is null");
+SEXP extract_genotypes(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, int threads = 1,
+                       Nullable<CharacterVector> samples = R_NilValue, std::string filter = "", bool transpose = false) {
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    source.filter = filter;
+    if (GenotypeStore::is_store(vcf)) {
+        if (!filter.empty()) stop("filter is not supported on a genotype store");
+        return store_extract_genotypes(vcf, region, source.samples, threads, transpose);
+    }
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    int n_samples = bcf_hdr_nsamples(reader.hdr);
+    Rprintf("detecting %d samples\n", n_samples);
+
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    if (transpose) {
+        if (!reader.rewindable()) {
+            stop("transpose needs a bgzipped file, as the records are read twice");
         }
-    } else {
-        tbi_idx = tbx_index_load2(vcf.c_str(), index.c_str());
-        if(!tbi_idx) {
-            stop("tbi index is null");
+        std::vector<CountKernel> counts(shards.size());
+        std::vector<VcfKernel*> count_ptrs = kernel_ptrs(counts);
+        scan_shards(source, reader, shards, count_ptrs, threads);
+
+        size_t num_variants = 0, n_haps = 2 * n_samples;
+        for (size_t k = 0; k < counts.size(); k++) num_variants += counts[k].n;
+        IntegerVector genotypes(num_variants * n_haps);
+        std::vector<TransposedGenotypeKernel> kernels(shards.size());
+        size_t row = 0;
+        for (size_t k = 0; k < kernels.size(); k++) {
+            kernels[k].place(genotypes.begin(), num_variants, row, counts[k].n, n_haps);
+            row += counts[k].n;
+        }
+        std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+        scan_shards(source, reader, shards, ptrs, threads);
+        for (size_t k = 0; k < kernels.size(); k++) {
+            kernels[k].flush();
+            if ((size_t) kernels[k].num_variants != counts[k].n) {
+                stop("the region has fewer records than when it was counted; was the file changed?");
+            }
         }
+        genotypes.attr("dim") = Dimension(num_variants, n_haps); // variants x haplotypes
+        return genotypes;
     }
 
-    bcf_hdr_t *hdr = bcf_hdr_read(fp);
-    if (!hdr) REprintf("can't reader header for vcf %s", vcf);
-    bcf1_t *line = bcf_init();
+    std::vector<GenotypeKernel> kernels(shards.size());
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
 
-    hts_itr_t *itr;
-    if (use_csi) {
-        itr = bcf_itr_querys(csi_idx, hdr, reg.c_str());
-    } else {
-        itr = tbx_itr_querys(tbi_idx, reg.c_str());
-        if(!itr) stop("itr is null");
+    size_t n_alleles = 0;
+    int num_variants = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        n_alleles += kernels[k].genotypes.size();
+        num_variants += kernels[k].num_variants;
+    }
+    IntegerVector genotypes(n_alleles);
+    IntegerVector::iterator out = genotypes.begin();
+    for (size_t k = 0; k < kernels.size(); k++) {
+        out = std::copy(kernels[k].genotypes.begin(), kernels[k].genotypes.end(), out);
     }
-    int r;
-    int ret;
-    kstring_t s = {0, 0, NULL}; // needs to be initialized to prevent segfault    
 
-    bcf_info_t *info;
-    int i, j, ngt, n_samples = bcf_hdr_nsamples(hdr);
-    int32_t *gt_arr = NULL, ngt_arr = 0;
-    int num_variants = 0;
-    // int32_t **gt_all = NULL;
-    // std::vector<IntegerVector> genotype_matrix; // rows are variants, columns are genotypes
-    IntegerVector genotypes;
+    // got this idea from https://stackoverflow.com/questions/19864226/convert-stdvector-to-rcpp-matrix
+    genotypes.attr("dim") = Dimension(2 * n_samples, num_variants); // haplotypes x variants
+
+    return genotypes;
+}
+
+// regions as "chr:start-end" strings or a data.frame with chrom, start and end (1-based, inclusive)
+static std::vector<QueryInterval> query_intervals(SEXP regions) {
+    std::vector<QueryInterval> queries;
+    if (TYPEOF(regions) == STRSXP) {
+        std::vector<std::string> regs = as<std::vector<std::string> >(regions);
+        for (size_t i = 0; i < regs.size(); i++) {
+            int beg, end;
+            const char *q = hts_parse_reg(regs[i].c_str(), &beg, &end);
+            if (!q) stop("couldn't parse region %s", regs[i]);
+            QueryInterval query = {std::string(regs[i].c_str(), q - regs[i].c_str()), beg, end};
+            queries.push_back(query);
+        }
+        return queries;
+    }
+
+    DataFrame df = as<DataFrame>(regions);
+    if (!df.containsElementNamed("chrom") || !df.containsElementNamed("start") || !df.containsElementNamed("end")) {
+        stop("regions must be a character vector or a data.frame with chrom, start and end columns");
+    }
+    CharacterVector chrom = as<CharacterVector>(df["chrom"]);
+    IntegerVector start = as<IntegerVector>(df["start"]);
+    IntegerVector end = as<IntegerVector>(df["end"]);
+    for (int i = 0; i < chrom.size(); i++) {
+        QueryInterval query = {as<std::string>(chrom[i]), start[i] - 1, end[i]};
+        queries.push_back(query);
+    }
+    return queries;
+}
+
+// the queries each record matched, as 1-based indices into regions
+static List query_column(const RegionHits& hits) {
+    List out(hits.ends.size());
+    size_t start = 0;
+    for (size_t i = 0; i < hits.ends.size(); i++) {
+        IntegerVector matched(hits.ends[i] - start);
+        for (size_t j = start; j < hits.ends[i]; j++) matched[j - start] = hits.queries[j] + 1;
+        out[i] = matched;
+        start = hits.ends[i];
+    }
+    return out;
+}
+
+//' extract INFO values for a batch of regions in one pass
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path
+//' @param regions a character vector of region queries of the form chr:start-end, or a data.frame with chrom,
+//' start and end columns (1-based, inclusive; add 1 to the start of a BED file)
+//' @param tag a character vector of INFO fields to extract, as in extract_info
+//' @param threads the number of threads used for BGZF decompression and, for a TBI-indexed VCF, line parsing
+//' @param filter an optional site filter expression, as in extract_info
+//' @description Use this function instead of calling extract_info once per interval when there are many small
+//' intervals. The index and header are loaded once, overlapping and adjacent intervals are merged so that
+//' records shared by neighbouring intervals are read once, and the merged intervals are read in order with a
+//' single file handle.
+//' @return a dataframe as from extract_info with an extra query column: a list holding, for every record, the
+//' indices of the regions it overlaps. Records are ordered by contig (in order of first appearance in regions)
+//' and position, and reported once even when they overlap several regions.
+//' @examples
+//' \dontrun{
+//' genes <- data.frame(chrom = "1", start = c(11869, 14404, 69091), end = c(14409, 29570, 70008))
+//' extract_info_regions(vcf, index, genes, c("AC", "AF"))
+//' }
+// [[Rcpp::export]]
+DataFrame extract_info_regions(std::string vcf, std::string index, SEXP regions, std::vector<std::string> tag,
+                               int threads = 1, std::string filter = "") {
+    VcfSource source = {vcf, index};
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+    reader.set_threads(threads);
+
+    bcf_hdr_t *hdr = reader.hdr;
+    std::vector<InfoField> fields = resolve_info_fields(hdr, tag);
+    QueryRegions batch(query_intervals(regions));
+    std::vector<InfoKernel> kernels(1, InfoKernel(fields, hdr->n[BCF_DT_ID]));
+    RegionHits hits;
+    scan_regions(reader, batch, &kernels[0], &hits);
 
+    List columns;
+    CharacterVector names;
+    size_t n = info_columns(hdr, fields, kernels, columns, names);
+    List out(columns.size() + 1);
+    CharacterVector out_names(columns.size() + 1);
+    for (int c = 0; c < columns.size(); c++) {
+        out[c] = columns[c];
+        out_names[c] = names[c];
+    }
+    out[columns.size()] = query_column(hits);
+    out_names[columns.size()] = "query";
+    return make_data_frame(out, out_names, n);
+}
+
+//' extract genotypes for a batch of regions in one pass
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path
+//' @param regions a character vector of region queries of the form chr:start-end, or a data.frame with chrom,
+//' start and end columns (1-based, inclusive; add 1 to the start of a BED file)
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads used for BGZF decompression and, for a TBI-indexed VCF, line parsing
+//' @param filter an optional site filter expression, as in extract_genotypes
+//' @description Use this function instead of calling extract_genotypes once per interval when there are many
+//' small intervals. Overlapping and adjacent intervals are merged and read in order with a single file handle,
+//' so each record is decoded once.
+//' @return a list with the chrom and pos of each record, query, a list holding the indices of the regions each
+//' record overlaps, and genotypes, an integer matrix of dimension (number of haplotypes x number of records)
+//' @examples
+//' \dontrun{extract_genotypes_regions(vcf, index, c("1:11869-14409", "1:14404-29570"))}
+// [[Rcpp::export]]
+List extract_genotypes_regions(std::string vcf, std::string index, SEXP regions,
+                               Nullable<CharacterVector> samples = R_NilValue, int threads = 1, std::string filter = "") {
+    VcfSource source = {vcf, index};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+    reader.set_threads(threads);
+
+    int n_samples = bcf_hdr_nsamples(reader.hdr);
     Rprintf("detecting %d samples\n", n_samples);
-    if (use_csi) {
-        // TODO: refactor so there is less repeated code
-        while((r = bcf_itr_next(fp, itr, line)) >= 0) {
-            num_variants++;
 
-            // https://github.com/samtools/htslib/blob/2da4c7dd951428fa9d0d4049394045d1cace4133/htslib/vcf.h#L790
-            ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
-            int max_ploidy = ngt / n_samples;
-            if(max_ploidy != 2) stop("currently only support for diploid organisms");
+    QueryRegions batch(query_intervals(regions));
+    GenotypeKernel kernel;
+    RegionHits hits;
+    scan_regions(reader, batch, &kernel, &hits);
+
+    size_t n = hits.rids.size();
+    CharacterVector chroms(n);
+    IntegerVector positions(n);
+    for (size_t i = 0; i < n; i++) {
+        chroms[i] = bcf_hdr_id2name(reader.hdr, hits.rids[i]);
+        positions[i] = hits.positions[i];
+    }
+    IntegerVector genotypes(kernel.genotypes.begin(), kernel.genotypes.end());
+    genotypes.attr("dim") = Dimension(2 * n_samples, kernel.num_variants); // haplotypes x variants
 
-            for (i = 0; i < n_samples; i++) {
-                int32_t *ptr = gt_arr + i * max_ploidy; // pointer to ith individual's genotypes
+    return List::create(
+        Named("chrom") = chroms,
+        Named("pos") = positions,
+        Named("query") = query_column(hits),
+        Named("genotypes") = genotypes
+    );
+}
 
-                for(j = 0; j < max_ploidy; j++) {
+// the normalized allele key of a site: contig id, 0-based position and upper-cased alleles
+static std::string allele_key(int rid, int pos, const char *ref, const char *alt) {
+    std::string key = std::to_string(rid) + ":" + std::to_string(pos) + ":";
+    for (const char *p = ref; *p; p++) key += toupper(*p);
+    key += ':';
+    for (const char *p = alt; *p; p++) key += toupper(*p);
+    return key;
+}
 
-                    if ( ptr[j]==bcf_int32_vector_end ) break;
+// the header's name for a query contig, trying it with and without a "chr" prefix; -1 if unknown
+static int resolve_contig(bcf_hdr_t *hdr, const std::string& chrom) {
+    int rid = bcf_hdr_name2id(hdr, chrom.c_str());
+    if (rid >= 0) return rid;
+    if (chrom.compare(0, 3, "chr") == 0) return bcf_hdr_name2id(hdr, chrom.c_str() + 3);
+    return bcf_hdr_name2id(hdr, ("chr" + chrom).c_str());
+}
 
-                    if ( bcf_gt_is_missing(ptr[j]) ) stop("missing value support not yet added");
+// matches each record's REF/ALT pairs against the query keys. Only records
+// matching some key are passed on to the INFO kernel, so `info` holds one row
+// per matched record.
+class LookupKernel : public VcfKernel {
+public:
+    LookupKernel(const std::unordered_map<std::string, std::vector<int> >& keys, InfoKernel& info, int n_queries)
+        : keys(keys), info(info), record(n_queries, -1), allele(n_queries, NA_INTEGER), swapped(n_queries, 0) {}
 
-                    int allele_index = bcf_gt_allele(ptr[j]);
-                    // Rprintf("sample i: %d and allele_index %d\n", i, allele_index);
-                    genotypes.push_back(allele_index);
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        bcf_unpack(line, BCF_UN_STR);
+        int row = -1;
+        for (int a = 1; a < line->n_allele; a++) {
+            for (int flip = 0; flip < 2; flip++) {
+                const char *ref = line->d.allele[flip ? a : 0];
+                const char *alt = line->d.allele[flip ? 0 : a];
+                std::unordered_map<std::string, std::vector<int> >::const_iterator it =
+                    keys.find(allele_key(line->rid, line->pos, ref, alt));
+                if (it == keys.end()) continue;
+                for (size_t i = 0; i < it->second.size(); i++) {
+                    int q = it->second[i];
+                    if (record[q] >= 0 && !swapped[q]) continue; // an exact match wins over a swapped one
+                    if (record[q] >= 0 && flip) continue;
+                    if (row < 0) {
+                        row = ids.size();
+                        ids.push_back(line->d.id);
+                        if (!info.add(hdr, line)) return false;
+                    }
+                    record[q] = row;
+                    allele[q] = a;
+                    swapped[q] = flip;
                 }
             }
+        }
+        return true;
+    }
 
+    const std::unordered_map<std::string, std::vector<int> >& keys;
+    InfoKernel& info;
+    std::vector<std::string> ids;
+    std::vector<int> record;  // row in info of each query's match, -1 when not found
+    std::vector<int> allele;  // the matching ALT allele, 1-based
+    std::vector<char> swapped;
+};
+
+// the given rows of a column as built by collect_info_column; -1 gives NA
+static SEXP subset_rows(SEXP x, const std::vector<int>& rows) {
+    size_t n = rows.size();
+    switch (TYPEOF(x)) {
+        case INTSXP: {
+            IntegerVector in(x), out(n);
+            for (size_t i = 0; i < n; i++) out[i] = rows[i] < 0 ? NA_INTEGER : in[rows[i]];
+            if (in.hasAttribute("levels")) {
+                out.attr("levels") = in.attr("levels");
+                out.attr("class") = "factor";
+            }
+            return out;
         }
-    } else {
-        while((r = tbx_itr_next(fp, tbi_idx, itr, &s)) >= 0) {
+        case LGLSXP: {
+            LogicalVector in(x), out(n);
+            for (size_t i = 0; i < n; i++) out[i] = rows[i] < 0 ? NA_LOGICAL : in[rows[i]];
+            return out;
+        }
+        case REALSXP: {
+            NumericVector in(x), out(n);
+            for (size_t i = 0; i < n; i++) out[i] = rows[i] < 0 ? NA_REAL : in[rows[i]];
+            return out;
+        }
+        default: {
+            List in(x), out(n);
+            for (size_t i = 0; i < n; i++) {
+                if (rows[i] >= 0) out[i] = in[rows[i]];
+            }
+            return out;
+        }
+    }
+}
 
-            ret = vcf_parse(&s, hdr, line);
-            if(ret > 0) stop("vcf parsing error");
+//' look up specific alleles by chrom, pos, ref and alt in one pass
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path
+//' @param keys a data.frame with chrom, pos (1-based), ref and alt columns, e.g. GWAS summary statistics
+//' @param tag an optional character vector of INFO fields to return for the matched records, as in extract_info
+//' @param max_gap keys on the same contig closer than this many bases are read through in one region rather
+//' than each seeking through the index
+//' @param threads the number of threads used for BGZF decompression and, for a TBI-indexed VCF, line parsing
+//' @description Use this function to match millions of alleles against a reference VCF without a region query
+//' per key or a full extraction. The keys are sorted and grouped into regions, which are read in order with
+//' a single file handle, and every REF/ALT pair of every record read is looked up in a hash of the keys.
+//' @details Keys match on contig (with or without a "chr" prefix), position and upper-cased alleles, with each
+//' ALT allele of a multi-allelic record tried in turn. A key with ref and alt swapped still matches, with
+//' swapped set; a match with the alleles as given wins over a swapped one. Alleles are compared as written, so
+//' indels have to be represented (e.g. left-aligned) the same way in both.
+//' @return a dataframe in the order of keys with found, swapped, allele (the 1-based ALT allele matched), the
+//' matched record's id, and one column per INFO field in tag
+//' @examples
+//' \dontrun{
+//' gwas <- read.table("sumstats.tsv", header = TRUE)
+//' hits <- lookup_variants(vcf, index, gwas[, c("chrom", "pos", "ref", "alt")], tag = "AF")
+//' gwas$ref_af <- ifelse(hits$swapped, 1 - hits$AF, hits$AF)
+//' }
+// [[Rcpp::export]]
+DataFrame lookup_variants(std::string vcf, std::string index, DataFrame keys,
+                          Nullable<CharacterVector> tag = R_NilValue, int max_gap = 100000, int threads = 1) {
+    if (!keys.containsElementNamed("chrom") || !keys.containsElementNamed("pos") ||
+        !keys.containsElementNamed("ref") || !keys.containsElementNamed("alt")) {
+        stop("keys must be a data.frame with chrom, pos, ref and alt columns");
+    }
+    CharacterVector chrom = as<CharacterVector>(keys["chrom"]);
+    IntegerVector pos = as<IntegerVector>(keys["pos"]);
+    CharacterVector ref = as<CharacterVector>(keys["ref"]);
+    CharacterVector alt = as<CharacterVector>(keys["alt"]);
+    int n_queries = chrom.size();
+
+    VcfSource source = {vcf, index};
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+    reader.set_threads(threads);
+    bcf_hdr_t *hdr = reader.hdr;
+
+    // hash the normalized keys, and sort them by contig and position to plan the regions
+    std::unordered_map<std::string, std::vector<int> > key_map;
+    std::vector<std::pair<int, int> > sites; // (rid, 0-based pos)
+    for (int q = 0; q < n_queries; q++) {
+        if (chrom[q] == NA_STRING || pos[q] == NA_INTEGER || ref[q] == NA_STRING || alt[q] == NA_STRING) continue;
+        int rid = resolve_contig(hdr, as<std::string>(chrom[q]));
+        if (rid < 0) continue;
+        std::string r = as<std::string>(ref[q]), a = as<std::string>(alt[q]);
+        key_map[allele_key(rid, pos[q] - 1, r.c_str(), a.c_str())].push_back(q);
+        sites.push_back(std::make_pair(rid, pos[q] - 1));
+    }
+    std::sort(sites.begin(), sites.end());
+
+    std::vector<QueryInterval> intervals;
+    for (size_t i = 0; i < sites.size(); i++) {
+        if (!intervals.empty() && i > 0 && sites[i - 1].first == sites[i].first &&
+            sites[i].second - intervals.back().end < max_gap) {
+            intervals.back().end = std::max(intervals.back().end, sites[i].second + 1);
+            continue;
+        }
+        QueryInterval interval = {bcf_hdr_id2name(hdr, sites[i].first), sites[i].second, sites[i].second + 1};
+        intervals.push_back(interval);
+    }
+    Rprintf("looking up %d keys in %d regions\n", (int) sites.size(), (int) intervals.size());
+
+    std::vector<std::string> tags;
+    if (tag.isNotNull()) tags = as<std::vector<std::string> >(tag.get());
+    std::vector<InfoField> fields = resolve_info_fields(hdr, tags);
+    std::vector<InfoKernel> info(1, InfoKernel(fields, hdr->n[BCF_DT_ID]));
+    LookupKernel kernel(key_map, info[0], n_queries);
+    QueryRegions batch(intervals);
+    scan_regions(reader, batch, &kernel, NULL);
+
+    List columns;
+    CharacterVector names;
+    info_columns(hdr, fields, info, columns, names);
+
+    LogicalVector found(n_queries), swapped(n_queries);
+    IntegerVector allele(n_queries);
+    CharacterVector ids(n_queries);
+    for (int q = 0; q < n_queries; q++) {
+        int row = kernel.record[q];
+        found[q] = row >= 0;
+        swapped[q] = row >= 0 ? (int) kernel.swapped[q] : NA_LOGICAL;
+        allele[q] = kernel.allele[q];
+        if (row >= 0) {
+            ids[q] = kernel.ids[row];
+        } else {
+            ids[q] = NA_STRING;
+        }
+    }
 
-            num_variants++;
+    // columns 0 and 1 of the INFO frame are the chrom and pos the keys already have
+    List out(4 + fields.size());
+    CharacterVector out_names(4 + fields.size());
+    out[0] = found;
+    out_names[0] = "found";
+    out[1] = swapped;
+    out_names[1] = "swapped";
+    out[2] = allele;
+    out_names[2] = "allele";
+    out[3] = ids;
+    out_names[3] = "id";
+    for (size_t c = 0; c < fields.size(); c++) {
+        out[4 + c] = subset_rows(columns[2 + c], kernel.record);
+        out_names[4 + c] = names[2 + c];
+    }
+    return make_data_frame(out, out_names, n_queries);
+}
 
-            ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
-            int max_ploidy = ngt / n_samples;
-            if(max_ploidy != 2) stop("currently only support for diploid organisms");
+template <class V>
+static void set_format_dims(V& values, int n, CharacterVector sample_names, int depth, bool is_scalar) {
+    if (is_scalar) {
+        values.attr("dim") = Dimension(n, sample_names.size());
+        values.attr("dimnames") = List::create(R_NilValue, sample_names);
+    } else {
+        values.attr("dim") = Dimension(n, sample_names.size(), depth);
+        values.attr("dimnames") = List::create(R_NilValue, sample_names, R_NilValue);
+    }
+}
 
-            for (i = 0; i < n_samples; i++) {
-                int32_t *ptr = gt_arr + i * max_ploidy; // pointer to ith individual's genotypes
+//' extract a numeric FORMAT field (e.g. DP, GQ, AD, PL) for every sample in a region
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param tag the Integer or Float FORMAT field to extract
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads. The region is split into this many shards, aligned to the
+//' index's linear windows, which are read concurrently with one file handle each.
+//' @param filter an optional site filter expression over QUAL, POS, N_ALT, FILTER and INFO fields, e.g.
+//' 'FILTER == "PASS" && QUAL > 30 && AF >= 0.01 && AF <= 0.99'. Sites failing it are dropped before their
+//' FORMAT fields are decoded.
+//' @description Use this function to pull per-sample FORMAT values into a typed matrix. Fields with
+//' Number=1 give a variants x samples matrix. Fields with any other Number (e.g. AD with Number=R, or PL
+//' with Number=G) give a variants x samples x values array, where the third dimension is the largest number of
+//' values seen in the region and shorter records are padded with NA. Missing values are NA.
+//' @details A bgzipped file is read twice: once to count the records (and the values per sample), and again to
+//' write each value straight into the preallocated result, so memory use stays at about one copy of it. A plain
+//' or plain-gzip VCF can only be read once, so its values are buffered and then copied, which needs about twice
+//' as much.
+//' @return a list with the chrom and pos of each record, and value, an integer or numeric matrix/array
+//' with the sample names as column names
+//' @examples
+//' \dontrun{extract_format(vcf, index, "1:10001-100500", "AD", samples = c("NA12878", "NA12891"))}
+// [[Rcpp::export]]
+List extract_format(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::string tag,
+                    Nullable<CharacterVector> samples = R_NilValue, int threads = 1, std::string filter = "") {
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
 
-                for(j = 0; j < max_ploidy; j++) {
+    bcf_hdr_t *hdr = reader.hdr;
+    int id = bcf_hdr_id2int(hdr, BCF_DT_ID, tag.c_str());
+    if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_FMT, id)) stop("format field %s does not exist", tag);
+    int type = bcf_hdr_id2type(hdr, BCF_HL_FMT, id);
+    if (type != BCF_HT_INT && type != BCF_HT_REAL) stop("format field %s is not an Integer or Float", tag);
+    bool is_int = type == BCF_HT_INT;
+    bool is_scalar = bcf_hdr_id2length(hdr, BCF_HL_FMT, id) == BCF_VL_FIXED &&
+                     bcf_hdr_id2number(hdr, BCF_HL_FMT, id) == 1;
 
-                    if ( ptr[j]==bcf_int32_vector_end ) break;
+    int n_samples = bcf_hdr_nsamples(hdr);
+    Rprintf("detecting %d samples\n", n_samples);
 
-                    if ( bcf_gt_is_missing(ptr[j]) ) stop("missing value support not yet added");
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    std::vector<FormatKernel> kernels(shards.size(), FormatKernel(tag, is_int));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
 
-                    int allele_index = bcf_gt_allele(ptr[j]);
-                    genotypes.push_back(allele_index);
+    // column-major variants x samples (x values); element (v, j, d) is at v + n * (j + n_samples * d)
+    IntegerVector int_values;
+    NumericVector num_values;
+    int n = 0, depth = 1;
+    if (reader.rewindable()) {
+        // count first, so the values are written straight into the result
+        std::vector<FormatCountKernel> counts(shards.size(), FormatCountKernel(tag, !is_scalar));
+        std::vector<VcfKernel*> count_ptrs = kernel_ptrs(counts);
+        scan_shards(source, reader, shards, count_ptrs, threads);
+        size_t total = 0;
+        for (size_t k = 0; k < counts.size(); k++) {
+            total += counts[k].n;
+            depth = std::max(depth, counts[k].depth);
+        }
+        n = (int) total;
+        if (is_int) {
+            int_values = IntegerVector((size_t) n * n_samples * depth, NA_INTEGER);
+        } else {
+            num_values = NumericVector((size_t) n * n_samples * depth, NA_REAL);
+        }
+        size_t row = 0;
+        for (size_t k = 0; k < kernels.size(); k++) {
+            kernels[k].place(is_int ? int_values.begin() : NULL, is_int ? NULL : num_values.begin(), n, row,
+                             counts[k].n, depth);
+            row += counts[k].n;
+        }
+        scan_shards(source, reader, shards, ptrs, threads);
+        for (size_t k = 0; k < kernels.size(); k++) {
+            if (kernels[k].rids.size() != counts[k].n) {
+                stop("the region has fewer records than when it was counted; was the file changed?");
+            }
+        }
+    } else {
+        // a stream that can't be read twice is buffered per shard and then copied
+        scan_shards(source, reader, shards, ptrs, threads);
+        for (size_t k = 0; k < kernels.size(); k++) {
+            n += kernels[k].rids.size();
+            if (!is_scalar) {
+                for (size_t i = 0; i < kernels[k].widths.size(); i++) depth = std::max(depth, kernels[k].widths[i]);
+            }
+        }
+        if (is_int) {
+            int_values = IntegerVector((size_t) n * n_samples * depth, NA_INTEGER);
+        } else {
+            num_values = NumericVector((size_t) n * n_samples * depth, NA_REAL);
+        }
+        size_t row = 0;
+        for (size_t k = 0; k < kernels.size(); k++) {
+            const FormatKernel& kernel = kernels[k];
+            size_t offset = 0;
+            for (size_t i = 0; i < kernel.rids.size(); i++, row++) {
+                int width = kernel.widths[i];
+                if (is_int) {
+                    place_format_values(kernel.ints.data() + offset, width, depth, int_values.begin(), row, n, n_samples);
+                } else {
+                    place_format_values(kernel.floats.data() + offset, width, depth, num_values.begin(), row, n,
+                                        n_samples);
                 }
+                offset += (size_t) width * n_samples;
             }
-
         }
     }
 
+    CharacterVector chroms(n);
+    IntegerVector positions(n);
+    int v = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        for (size_t i = 0; i < kernels[k].rids.size(); i++, v++) {
+            chroms[v] = bcf_hdr_id2name(hdr, kernels[k].rids[i]);
+            positions[v] = kernels[k].positions[i];
+        }
+    }
+    CharacterVector sample_names(n_samples);
+    for (int j = 0; j < n_samples; j++) sample_names[j] = hdr->samples[j];
 
-    bcf_destroy(line);
-    hts_close(fp);
-
-    // got this idea from https://stackoverflow.com/questions/19864226/convert-stdvector-to-rcpp-matrix
-    genotypes.attr("dim") = Dimension(ngt, num_variants); // haplotypes x variants
+    if (is_int) {
+        set_format_dims(int_values, n, sample_names, depth, is_scalar);
+    } else {
+        set_format_dims(num_values, n, sample_names, depth, is_scalar);
+    }
 
-    return genotypes;
+    return List::create(
+        Named("chrom") = chroms,
+        Named("pos") = positions,
+        Named("value") = is_int ? (SEXP) int_values : (SEXP) num_values
+    );
 }
@@ -0,0 +1,397 @@
+#include<Rcpp.h>
+#include <cmath>
+#include <unordered_map>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+// what every variant's score test needs from the null model, O(samples x
+// covariates). With w the square roots of the null-model weights (1 for a
+// linear model, mu(1 - mu) for a logistic one; 0 for dropped samples) and Q an
+// orthonormal basis of diag(w) X, the score of a dosage vector g and its
+// variance are
+//   U = g'r,  V = scale * (|w g|^2 - |Q'(w g)|^2)
+// where r are the null-model residuals and scale is the residual variance of
+// a linear model (1 for a logistic one).
+struct NullModel {
+    int n_samples;
+    int n_used;
+    std::vector<char> used;
+    std::vector<double> w;
+    std::vector<double> r;
+    std::vector<double> q; // column-major, n_samples x n_q
+    int n_q;
+    double scale;
+};
+
+// a'b with four independent accumulators. A single running sum is a serial
+// dependency chain the compiler may not reorder (that would change the
+// floating point result), so it can't use SIMD lanes; four partial sums can.
+static double dot(const double *a, const double *b, int n) {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; i++) s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+// orthonormalize the columns of a (column-major, n x p) in place with modified
+// Gram-Schmidt, dropping (near-)collinear ones; returns how many are kept
+static int orthonormalize(std::vector<double>& a, int n, int p) {
+    int kept = 0;
+    for (int j = 0; j < p; j++) {
+        double *col = &a[(size_t) j * n];
+        double norm0 = dot(col, col, n);
+        for (int k = 0; k < kept; k++) {
+            const double *qk = &a[(size_t) k * n];
+            double proj = dot(qk, col, n);
+            for (int i = 0; i < n; i++) col[i] -= proj * qk[i];
+        }
+        double norm = dot(col, col, n);
+        if (norm <= 1e-10 * norm0 || norm == 0) continue;
+        norm = std::sqrt(norm);
+        double *dest = &a[(size_t) kept * n];
+        for (int i = 0; i < n; i++) dest[i] = col[i] / norm;
+        kept++;
+    }
+    a.resize((size_t) kept * n);
+    return kept;
+}
+
+// fit the null model of y on an intercept plus the covariates x (column-major,
+// n x k) over the samples with no missing values. Logistic models are fitted
+// by IRLS, each step being a weighted least-squares projection onto Q.
+static void fit_null_model(const std::vector<double>& y, const std::vector<double>& x, int k, bool logistic, NullModel& m) {
+    int n = y.size();
+    m.n_samples = n;
+    m.used.assign(n, 1);
+    for (int i = 0; i < n; i++) {
+        if (std::isnan(y[i])) m.used[i] = 0;
+        for (int j = 0; j < k; j++) {
+            if (std::isnan(x[(size_t) j * n + i])) m.used[i] = 0;
+        }
+        if (logistic && m.used[i] && y[i] != 0 && y[i] != 1) stop("a logistic model needs a 0/1 phenotype");
+    }
+    m.n_used = 0;
+    for (int i = 0; i < n; i++) m.n_used += m.used[i];
+    if (m.n_used <= k + 1) stop("too few samples with a phenotype and all covariates");
+
+    // the design matrix, with the intercept first and dropped samples zeroed
+    int p = k + 1;
+    std::vector<double> design((size_t) n * p, 0.0);
+    for (int i = 0; i < n; i++) {
+        if (!m.used[i]) continue;
+        design[i] = 1;
+        for (int j = 0; j < k; j++) design[(size_t) (j + 1) * n + i] = x[(size_t) j * n + i];
+    }
+
+    std::vector<double> eta(n, 0.0), mu(n), z(n), coef(n);
+    m.w.assign(n, 0.0);
+    m.r.assign(n, 0.0);
+    int iterations = logistic ? 25 : 1;
+    for (int it = 0; it < iterations; it++) {
+        // working weights and response; for a linear model that is just y with unit weights
+        for (int i = 0; i < n; i++) {
+            if (!m.used[i]) continue;
+            if (logistic) {
+                mu[i] = 1 / (1 + std::exp(-eta[i]));
+                double v = std::max(mu[i] * (1 - mu[i]), 1e-10);
+                m.w[i] = std::sqrt(v);
+                z[i] = (eta[i] + (y[i] - mu[i]) / v) * m.w[i];
+            } else {
+                m.w[i] = 1;
+                z[i] = y[i];
+            }
+        }
+        m.q.assign((size_t) n * p, 0.0);
+        for (int j = 0; j < p; j++) {
+            for (int i = 0; i < n; i++) m.q[(size_t) j * n + i] = design[(size_t) j * n + i] * m.w[i];
+        }
+        m.n_q = orthonormalize(m.q, n, p);
+
+        // the fitted values of the weighted least-squares step are Q Q' z, unweighted
+        std::fill(coef.begin(), coef.end(), 0.0);
+        for (int j = 0; j < m.n_q; j++) {
+            const double *qj = &m.q[(size_t) j * n];
+            double proj = dot(qj, &z[0], n);
+            for (int i = 0; i < n; i++) coef[i] += proj * qj[i];
+        }
+        double change = 0;
+        for (int i = 0; i < n; i++) {
+            if (!m.used[i]) continue;
+            double fitted = coef[i] / m.w[i];
+            change = std::max(change, std::fabs(fitted - eta[i]));
+            eta[i] = fitted;
+        }
+        if (logistic && change < 1e-8) break;
+    }
+
+    double rss = 0;
+    for (int i = 0; i < n; i++) {
+        if (!m.used[i]) continue;
+        m.r[i] = logistic ? y[i] - 1 / (1 + std::exp(-eta[i])) : y[i] - eta[i];
+        rss += m.r[i] * m.r[i];
+    }
+    if (logistic) {
+        // the weights at the fitted null model, which the score variance needs
+        for (int i = 0; i < n; i++) {
+            if (!m.used[i]) continue;
+            double p_i = 1 / (1 + std::exp(-eta[i]));
+            m.w[i] = std::sqrt(std::max(p_i * (1 - p_i), 1e-10));
+        }
+        for (int j = 0; j < p; j++) {
+            for (int i = 0; i < n; i++) design[(size_t) j * n + i] *= m.w[i];
+        }
+        m.q.swap(design);
+        m.n_q = orthonormalize(m.q, n, p);
+        m.scale = 1;
+    } else {
+        m.scale = rss / (m.n_used - m.n_q);
+    }
+}
+
+// per-variant score statistics for a shard. add() only reads the shared null
+// model, so shards run concurrently.
+class ScoreTestKernel : public VcfKernel {
+public:
+    ScoreTestKernel(const NullModel& model, const std::string& tag)
+        : model(model), tag(tag), g(model.n_samples), wg(model.n_samples), buf(NULL), nbuf(0) {}
+    ScoreTestKernel(const ScoreTestKernel& other)
+        : model(other.model), tag(other.tag), g(other.g.size()), wg(other.wg.size()), buf(NULL), nbuf(0) {}
+    ~ScoreTestKernel() { free(buf); }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        int n = model.n_samples;
+        if (bcf_hdr_nsamples(hdr) != n) {
+            error = "the phenotype needs one value per sample";
+            return false;
+        }
+        if (!dosages(hdr, line)) return false;
+
+        // mean-impute missing dosages over the used samples
+        int n_called = 0;
+        double sum = 0;
+        for (int i = 0; i < n; i++) {
+            if (!model.used[i] || std::isnan(g[i])) continue;
+            n_called++;
+            sum += g[i];
+        }
+        double mean = n_called ? sum / n_called : 0;
+        for (int i = 0; i < n; i++) {
+            double gi = std::isnan(g[i]) ? mean : g[i];
+            g[i] = gi;
+            wg[i] = model.w[i] * gi; // w is 0 for dropped samples
+        }
+
+        double u = dot(&g[0], &model.r[0], n);
+        double a = dot(&wg[0], &wg[0], n);
+        double b = 0;
+        for (int j = 0; j < model.n_q; j++) {
+            double proj = dot(&model.q[(size_t) j * n], &wg[0], n);
+            b += proj * proj;
+        }
+
+        rids.push_back(line->rid);
+        positions.push_back(line->pos);
+        called.push_back(n_called);
+        af.push_back(n_called ? mean / 2 : NA_REAL);
+        scores.push_back(u);
+        residual_ss.push_back(a - b);
+        return true;
+    }
+
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        rids.reserve(n_records);
+        positions.reserve(n_records);
+        called.reserve(n_records);
+        af.reserve(n_records);
+        scores.reserve(n_records);
+        residual_ss.reserve(n_records);
+    }
+
+    const NullModel& model;
+    std::string tag;
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<int> called;
+    std::vector<double> af;
+    std::vector<double> scores;      // U
+    std::vector<double> residual_ss; // |w g|^2 - |Q'(w g)|^2, so V = scale * this
+
+private:
+    // the alternate allele dosage of every sample into g, NaN when missing
+    bool dosages(bcf_hdr_t *hdr, bcf1_t *line) {
+        int n = model.n_samples;
+        if (tag == "GT") {
+            int ngt = bcf_get_genotypes(hdr, line, (int32_t **) &buf, &nbuf);
+            int max_ploidy = ngt > 0 && n > 0 ? ngt / n : 0;
+            const int32_t *gt = (const int32_t *) buf;
+            for (int i = 0; i < n; i++) {
+                double dose = max_ploidy ? 0 : NAN;
+                for (int j = 0; j < max_ploidy; j++) {
+                    int32_t allele = gt[i * max_ploidy + j];
+                    if (allele == bcf_int32_vector_end) break;
+                    if (bcf_gt_is_missing(allele)) {
+                        dose = NAN;
+                        break;
+                    }
+                    dose += bcf_gt_allele(allele) != 0;
+                }
+                g[i] = dose;
+            }
+            return true;
+        }
+        int nv = bcf_get_format_float(hdr, line, tag.c_str(), (float **) &buf, &nbuf);
+        if (nv == -3) nv = 0; // the record doesn't carry this field
+        if (nv < 0) {
+            error = "couldn't read format field " + tag;
+            return false;
+        }
+        int width = n ? nv / n : 0;
+        const float *values = (const float *) buf;
+        for (int i = 0; i < n; i++) {
+            float v = width ? values[i * width] : 0;
+            g[i] = width == 0 || bcf_float_is_missing(v) || bcf_float_is_vector_end(v) ? NAN : v;
+        }
+        return true;
+    }
+
+    std::vector<double> g;
+    std::vector<double> wg;
+    void *buf;
+    int nbuf;
+};
+
+//' run single-variant score tests of a phenotype against every variant
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL for the whole file
+//' @param pheno a numeric phenotype, one value per sample (in the order of samples when given, otherwise of
+//' the VCF header). Samples with NA are left out.
+//' @param covariates an optional numeric matrix with one row per sample and one column per covariate. An
+//' intercept is always added. Samples with an NA covariate are left out.
+//' @param family "gaussian" for a linear model or "binomial" for a logistic model of a 0/1 phenotype
+//' @param tag "GT" to test alternate allele counts (all ALT alleles pooled), or a Float FORMAT field such as
+//' "DS" to test imputed dosages (its first value)
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads. The region is split into this many shards, aligned to the index's
+//' linear windows (one shard per contig for a whole-file scan), which are tested concurrently.
+//' @param filter an optional site filter expression, as in variant_stats
+//' @description Use this function for GWAS-style scans straight from a VCF/BCF, without exporting genotypes to R.
+//' The null model of the phenotype on the covariates is fitted once, and its residuals and a projection basis
+//' of the covariates are kept; each variant then costs a few dot products over the samples. Memory use grows
+//' with samples x covariates, not with the number of variants.
+//' @details Missing dosages are imputed with the variant's mean. The score statistic U = g'r is tested with
+//' chisq = U^2 / V on one degree of freedom, where V is its variance under the null with the covariates
+//' projected out. beta and se are the one-step estimates U / d and sqrt(scale / d), with d the covariate-adjusted
+//' sum of squares of the dosages.
+//' @return a dataframe with the chrom, pos, n (called samples tested), af, u, v, beta, se, chisq and p of each
+//' variant
+//' @examples
+//' \dontrun{
+//' res <- score_test(vcf, index, NULL, pheno = y, covariates = pcs[, 1:10], family = "binomial", threads = 8)
+//' head(res[order(res$p), ])
+//' }
+// [[Rcpp::export]]
+DataFrame score_test(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                     NumericVector pheno, Nullable<NumericMatrix> covariates = R_NilValue,
+                     std::string family = "gaussian", std::string tag = "GT",
+                     Nullable<CharacterVector> samples = R_NilValue, int threads = 1, std::string filter = "") {
+    if (family != "gaussian" && family != "binomial") stop("family must be gaussian or binomial");
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    // the reader keeps samples in header order; order[j] is where the j-th of them is in pheno
+    int n_samples = bcf_hdr_nsamples(reader.hdr);
+    std::unordered_map<std::string, int> given;
+    for (size_t i = 0; i < source.samples.size(); i++) given[source.samples[i]] = i;
+    std::vector<int> order(n_samples);
+    for (int j = 0; j < n_samples; j++) {
+        std::unordered_map<std::string, int>::const_iterator it = given.find(reader.hdr->samples[j]);
+        order[j] = it == given.end() ? j : it->second;
+    }
+    int n_given = source.samples.empty() ? n_samples : source.samples.size();
+    if (pheno.size() != n_given) stop("pheno has %d values for %d samples", pheno.size(), n_given);
+    if (tag != "GT") {
+        int id = bcf_hdr_id2int(reader.hdr, BCF_DT_ID, tag.c_str());
+        if (!bcf_hdr_idinfo_exists(reader.hdr, BCF_HL_FMT, id)) stop("format field %s does not exist", tag);
+        if (bcf_hdr_id2type(reader.hdr, BCF_HL_FMT, id) != BCF_HT_REAL) stop("format field %s is not a Float", tag);
+    }
+
+    std::vector<double> y(n_samples), x;
+    for (int j = 0; j < n_samples; j++) y[j] = pheno[order[j]];
+    int k = 0;
+    if (covariates.isNotNull()) {
+        NumericMatrix cov(covariates.get());
+        if (cov.nrow() != n_given) stop("covariates has %d rows for %d samples", cov.nrow(), n_given);
+        k = cov.ncol();
+        x.resize((size_t) n_samples * k);
+        for (int c = 0; c < k; c++) {
+            for (int j = 0; j < n_samples; j++) x[(size_t) c * n_samples + j] = cov(order[j], c);
+        }
+    }
+    NullModel model;
+    fit_null_model(y, x, k, family == "binomial", model);
+    Rprintf("null model fitted on %d samples with %d covariates\n", model.n_used, model.n_q - 1);
+
+    std::vector<VcfShard> shards;
+    if (region.empty() && threads > 1) shards = plan_contig_shards(reader);
+    if (shards.empty()) shards = plan_shards(reader, region, threads);
+    std::vector<ScoreTestKernel> kernels(shards.size(), ScoreTestKernel(model, tag));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    size_t n = 0;
+    for (size_t s = 0; s < kernels.size(); s++) n += kernels[s].rids.size();
+
+    CharacterVector chroms(n);
+    IntegerVector positions(n), called(n);
+    NumericVector af(n), u(n), v(n), beta(n), se(n), chisq(n), p(n);
+    size_t row = 0;
+    for (size_t s = 0; s < kernels.size(); s++) {
+        const ScoreTestKernel& kernel = kernels[s];
+        for (size_t i = 0; i < kernel.rids.size(); i++, row++) {
+            chroms[row] = bcf_hdr_id2name(reader.hdr, kernel.rids[i]);
+            positions[row] = kernel.positions[i];
+            called[row] = kernel.called[i];
+            af[row] = kernel.af[i];
+            double score = kernel.scores[i], d = kernel.residual_ss[i];
+            u[row] = score;
+            // a monomorphic variant, or one explained by the covariates, has nothing left to test
+            if (d <= 1e-8) {
+                v[row] = beta[row] = se[row] = chisq[row] = p[row] = NA_REAL;
+                continue;
+            }
+            double var = model.scale * d, stat = score * score / var;
+            v[row] = var;
+            beta[row] = score / d;
+            se[row] = std::sqrt(model.scale / d);
+            chisq[row] = stat;
+            p[row] = std::erfc(std::sqrt(stat / 2)); // upper tail of chi-squared with 1 df
+        }
+    }
+
+    return DataFrame::create(
+        Named("chrom") = chroms,
+        Named("pos") = positions,
+        Named("n") = called,
+        Named("af") = af,
+        Named("u") = u,
+        Named("v") = v,
+        Named("beta") = beta,
+        Named("se") = se,
+        Named("chisq") = chisq,
+        Named("p") = p
+    );
+}
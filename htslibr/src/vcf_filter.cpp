@@ -0,0 +1,366 @@
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include "htslib/vcf.h"
+#include "vcf_filter.h"
+using namespace std;
+
+enum { OP_OR, OP_AND, OP_NOT, OP_TRUTH, OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE };
+enum { TERM_NUM, TERM_STR, TERM_QUAL, TERM_POS, TERM_N_ALT, TERM_FILTER, TERM_INFO };
+enum { VALUE_NUM, VALUE_STR, VALUE_FILTER };
+static const int FILTER_NONE = -2; // FILTER == "."
+
+struct FilterToken {
+    enum { OP, STR, NUM, IDENT, END } kind;
+    std::string text;
+    double num;
+};
+
+static bool tokenize(const std::string& expr, std::vector<FilterToken>& tokens, std::string& error) {
+    size_t i = 0;
+    while (i < expr.size()) {
+        char c = expr[i];
+        if (isspace((unsigned char) c)) {
+            i++;
+            continue;
+        }
+        FilterToken token;
+        token.num = 0;
+        std::string two = expr.substr(i, 2);
+        if (two == "&&" || two == "||" || two == "==" || two == "!=" || two == "<=" || two == ">=") {
+            token.kind = FilterToken::OP;
+            token.text = two;
+            i += 2;
+        } else if (strchr("&|=<>!()", c)) {
+            // single & | = are accepted as in bcftools expressions
+            token.kind = FilterToken::OP;
+            token.text = c == '&' ? "&&" : c == '|' ? "||" : c == '=' ? "==" : std::string(1, c);
+            i++;
+        } else if (c == '"' || c == '\'') {
+            size_t close = expr.find(c, i + 1);
+            if (close == std::string::npos) {
+                error = "unterminated string in filter";
+                return false;
+            }
+            token.kind = FilterToken::STR;
+            token.text = expr.substr(i + 1, close - i - 1);
+            i = close + 1;
+        } else if (isdigit((unsigned char) c) || c == '.' || c == '-') {
+            char *end;
+            token.kind = FilterToken::NUM;
+            token.num = strtod(expr.c_str() + i, &end);
+            if (end == expr.c_str() + i) {
+                error = "unexpected '" + std::string(1, c) + "' in filter";
+                return false;
+            }
+            i = end - expr.c_str();
+        } else if (isalpha((unsigned char) c) || c == '_') {
+            size_t start = i;
+            while (i < expr.size() && (isalnum((unsigned char) expr[i]) || strchr("_./", expr[i]))) i++;
+            token.kind = FilterToken::IDENT;
+            token.text = expr.substr(start, i - start);
+        } else {
+            error = "unexpected '" + std::string(1, c) + "' in filter";
+            return false;
+        }
+        tokens.push_back(token);
+    }
+    FilterToken end = {FilterToken::END, "", 0};
+    tokens.push_back(end);
+    return true;
+}
+
+// recursive descent over the tokens: or := and ('||' and)*, and := not ('&&' not)*,
+// not := '!' not | '(' or ')' | operand [cmp operand]
+struct FilterParser {
+    const bcf_hdr_t *hdr;
+    std::vector<FilterToken> tokens;
+    size_t at;
+    std::vector<SiteFilter::Operand> operands;
+    std::vector<SiteFilter::Node> nodes;
+    std::vector<int> value_types;
+    std::string error;
+
+    bool accept(const char *op) {
+        if (tokens[at].kind != FilterToken::OP || tokens[at].text != op) return false;
+        at++;
+        return true;
+    }
+
+    int add_node(int op, int a, int b) {
+        SiteFilter::Node node = {op, a, b};
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+
+    int parse_or() {
+        int n = parse_and();
+        while (n >= 0 && accept("||")) {
+            int m = parse_and();
+            if (m < 0) return -1;
+            n = add_node(OP_OR, n, m);
+        }
+        return n;
+    }
+
+    int parse_and() {
+        int n = parse_not();
+        while (n >= 0 && accept("&&")) {
+            int m = parse_not();
+            if (m < 0) return -1;
+            n = add_node(OP_AND, n, m);
+        }
+        return n;
+    }
+
+    int parse_not() {
+        if (accept("!")) {
+            int n = parse_not();
+            return n < 0 ? -1 : add_node(OP_NOT, n, -1);
+        }
+        if (accept("(")) {
+            int n = parse_or();
+            if (n < 0) return -1;
+            if (!accept(")")) {
+                error = "missing ')' in filter";
+                return -1;
+            }
+            return n;
+        }
+        return parse_comparison();
+    }
+
+    int comparison_op() {
+        static const char *ops[] = {"==", "!=", "<", "<=", ">", ">="};
+        for (int i = 0; i < 6; i++) {
+            if (accept(ops[i])) return OP_EQ + i;
+        }
+        return -1;
+    }
+
+    int parse_comparison() {
+        int a = parse_operand();
+        if (a < 0) return -1;
+        int op = comparison_op();
+        if (op < 0) {
+            int kind = operands[a].kind;
+            if (kind == TERM_NUM || kind == TERM_STR || kind == TERM_FILTER) {
+                error = "expected a comparison in filter";
+                return -1;
+            }
+            return add_node(OP_TRUTH, a, -1);
+        }
+        int b = parse_operand();
+        if (b < 0) return -1;
+
+        int ta = value_types[a], tb = value_types[b];
+        if (ta == VALUE_FILTER || tb == VALUE_FILTER) {
+            // FILTER is a set; compare it against a literal filter name
+            if (tb == VALUE_FILTER) std::swap(a, b);
+            if (operands[b].kind != TERM_STR || (op != OP_EQ && op != OP_NE)) {
+                error = "FILTER can only be compared with == or != against a quoted filter name";
+                return -1;
+            }
+            if (operands[b].str == ".") {
+                operands[b].id = FILTER_NONE;
+            } else {
+                int id = bcf_hdr_id2int(hdr, BCF_DT_ID, operands[b].str.c_str());
+                if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_FLT, id)) {
+                    error = "filter " + operands[b].str + " is not defined in the header";
+                    return -1;
+                }
+                operands[b].id = id;
+            }
+        } else if (ta != tb) {
+            error = "filter compares a number with a string";
+            return -1;
+        } else if (ta == VALUE_STR && op != OP_EQ && op != OP_NE) {
+            error = "strings can only be compared with == or != in filter";
+            return -1;
+        }
+        return add_node(op, a, b);
+    }
+
+    int add_operand(int kind, int value_type, double num, const std::string& str, int id, int type) {
+        SiteFilter::Operand operand = {kind, num, str, id, type};
+        operands.push_back(operand);
+        value_types.push_back(value_type);
+        return operands.size() - 1;
+    }
+
+    int parse_operand() {
+        const FilterToken& token = tokens[at];
+        if (token.kind == FilterToken::NUM) {
+            at++;
+            return add_operand(TERM_NUM, VALUE_NUM, token.num, "", -1, -1);
+        }
+        if (token.kind == FilterToken::STR) {
+            at++;
+            return add_operand(TERM_STR, VALUE_STR, 0, token.text, -1, -1);
+        }
+        if (token.kind != FilterToken::IDENT) {
+            error = token.kind == FilterToken::END ? "filter ends too early" : "unexpected '" + token.text + "' in filter";
+            return -1;
+        }
+        at++;
+        if (token.text == "QUAL") return add_operand(TERM_QUAL, VALUE_NUM, 0, "", -1, -1);
+        if (token.text == "POS") return add_operand(TERM_POS, VALUE_NUM, 0, "", -1, -1);
+        if (token.text == "N_ALT") return add_operand(TERM_N_ALT, VALUE_NUM, 0, "", -1, -1);
+        if (token.text == "FILTER") return add_operand(TERM_FILTER, VALUE_FILTER, 0, "", -1, -1);
+
+        std::string tag = token.text.compare(0, 5, "INFO/") == 0 ? token.text.substr(5) : token.text;
+        int id = bcf_hdr_id2int(hdr, BCF_DT_ID, tag.c_str());
+        if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id)) {
+            error = "info field " + tag + " does not exist";
+            return -1;
+        }
+        int type = bcf_hdr_id2type(hdr, BCF_HL_INFO, id);
+        return add_operand(TERM_INFO, type == BCF_HT_STR ? VALUE_STR : VALUE_NUM, 0, tag, id, type);
+    }
+};
+
+bool SiteFilter::compile(const bcf_hdr_t *hdr, const std::string& expr, std::string& error) {
+    FilterParser parser;
+    parser.hdr = hdr;
+    parser.at = 0;
+    if (!tokenize(expr, parser.tokens, error)) return false;
+    if (parser.tokens.size() == 1) return true; // empty expression keeps every site
+
+    int n = parser.parse_or();
+    if (n >= 0 && parser.tokens[parser.at].kind != FilterToken::END) {
+        parser.error = "unexpected '" + parser.tokens[parser.at].text + "' in filter";
+        n = -1;
+    }
+    if (n < 0) {
+        error = parser.error;
+        return false;
+    }
+    operands.swap(parser.operands);
+    nodes.swap(parser.nodes);
+    root = n;
+    return true;
+}
+
+struct FilterValue {
+    bool missing;
+    double num;
+    const char *str;
+    int len;
+};
+
+// the first value of an INFO field, straight from the unpacked record
+static FilterValue info_value(const SiteFilter::Operand& operand, bcf1_t *line) {
+    FilterValue value = {true, 0, NULL, 0};
+    bcf_info_t *info = bcf_get_info_id(line, operand.id);
+    if (!info) return value;
+    if (operand.type == BCF_HT_FLAG) {
+        value.missing = false;
+        value.num = 1;
+        return value;
+    }
+    if (!info->vptr || info->len <= 0) return value;
+    if (operand.type == BCF_HT_STR) {
+        value.str = (const char *) info->vptr;
+        value.len = info->len;
+        while (value.len > 0 && value.str[value.len - 1] == '\0') value.len--; // BCF pads strings with NULs
+        value.missing = value.len == 1 && value.str[0] == '.';
+        return value;
+    }
+    switch (info->type) {
+        case BCF_BT_INT8: {
+            int8_t x = ((int8_t *) info->vptr)[0];
+            value.missing = x == bcf_int8_missing || x == bcf_int8_vector_end;
+            value.num = x;
+            break;
+        }
+        case BCF_BT_INT16: {
+            int16_t x = ((int16_t *) info->vptr)[0];
+            value.missing = x == bcf_int16_missing || x == bcf_int16_vector_end;
+            value.num = x;
+            break;
+        }
+        case BCF_BT_INT32: {
+            int32_t x = ((int32_t *) info->vptr)[0];
+            value.missing = x == bcf_int32_missing || x == bcf_int32_vector_end;
+            value.num = x;
+            break;
+        }
+        case BCF_BT_FLOAT: {
+            float x = ((float *) info->vptr)[0];
+            value.missing = bcf_float_is_missing(x) || bcf_float_is_vector_end(x);
+            value.num = x;
+            break;
+        }
+    }
+    return value;
+}
+
+static FilterValue term_value(const SiteFilter::Operand& operand, bcf1_t *line) {
+    FilterValue value = {false, 0, NULL, 0};
+    switch (operand.kind) {
+        case TERM_NUM: value.num = operand.num; break;
+        case TERM_STR: value.str = operand.str.c_str(); value.len = operand.str.size(); break;
+        case TERM_QUAL: value.missing = bcf_float_is_missing(line->qual); value.num = line->qual; break;
+        case TERM_POS: value.num = line->pos + 1; break;
+        case TERM_N_ALT: value.num = line->n_allele - 1; break;
+        case TERM_INFO: return info_value(operand, line);
+    }
+    return value;
+}
+
+static bool has_filter(bcf1_t *line, int id) {
+    if (id == FILTER_NONE) return line->d.n_flt == 0;
+    for (int i = 0; i < line->d.n_flt; i++) {
+        if (line->d.flt[i] == id) return true;
+    }
+    return false;
+}
+
+static bool is_float(const SiteFilter::Operand& operand) {
+    return operand.kind == TERM_QUAL || (operand.kind == TERM_INFO && operand.type == BCF_HT_REAL);
+}
+
+bool SiteFilter::eval(int n, bcf1_t *line) const {
+    const Node& node = nodes[n];
+    switch (node.op) {
+        case OP_OR: return eval(node.a, line) || eval(node.b, line);
+        case OP_AND: return eval(node.a, line) && eval(node.b, line);
+        case OP_NOT: return !eval(node.a, line);
+        case OP_TRUTH: {
+            FilterValue value = term_value(operands[node.a], line);
+            return !value.missing && (value.str != NULL || value.num != 0);
+        }
+    }
+
+    if (operands[node.a].kind == TERM_FILTER) {
+        bool has = has_filter(line, operands[node.b].id);
+        return node.op == OP_EQ ? has : !has;
+    }
+    FilterValue a = term_value(operands[node.a], line);
+    FilterValue b = term_value(operands[node.b], line);
+    if (a.missing || b.missing) return false;
+    if (is_float(operands[node.a]) || is_float(operands[node.b])) {
+        // QUAL and Float INFO are single precision, so AF >= 0.01 has to hold when AF is stored as 0.01
+        a.num = (float) a.num;
+        b.num = (float) b.num;
+    }
+    if (a.str) {
+        bool equal = a.len == b.len && memcmp(a.str, b.str, a.len) == 0;
+        return node.op == OP_EQ ? equal : !equal;
+    }
+    switch (node.op) {
+        case OP_EQ: return a.num == b.num;
+        case OP_NE: return a.num != b.num;
+        case OP_LT: return a.num < b.num;
+        case OP_LE: return a.num <= b.num;
+        case OP_GT: return a.num > b.num;
+        case OP_GE: return a.num >= b.num;
+    }
+    return false;
+}
+
+bool SiteFilter::pass(bcf1_t *line) const {
+    if (root < 0) return true;
+    bcf_unpack(line, BCF_UN_INFO); // shared fields only; FORMAT stays packed
+    return eval(root, line);
+}
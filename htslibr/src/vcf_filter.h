@@ -0,0 +1,48 @@
+#ifndef HTSLIBR_VCF_FILTER_H
+#define HTSLIBR_VCF_FILTER_H
+
+#include <string>
+#include <vector>
+#include "htslib/vcf.h"
+
+// a site filter expression compiled against a header, e.g.
+//   FILTER == "PASS" && QUAL > 30 && INFO/AF >= 0.01 && INFO/AF <= 0.99
+// Terms are QUAL, POS (1-based), N_ALT, FILTER, INFO tags (INFO/TAG or bare
+// TAG), numbers and quoted strings, combined with == != < <= > >=, && ||, !
+// and parentheses. A bare term is true when the value is present and, for
+// numbers, non-zero. Comparisons against a missing value are false.
+//
+// pass() only reads the shared part of the record (up to BCF_UN_INFO), so
+// sites can be rejected before any sample data is decoded. It keeps no
+// scratch state and can be called from several threads at once.
+class SiteFilter {
+public:
+    SiteFilter() : root(-1) {}
+
+    // returns false and fills in error if expr doesn't parse against hdr
+    bool compile(const bcf_hdr_t *hdr, const std::string& expr, std::string& error);
+    bool empty() const { return root < 0; }
+    bool pass(bcf1_t *line) const;
+
+    struct Operand {
+        int kind;
+        double num;
+        std::string str;
+        int id;   // INFO tag or FILTER id
+        int type; // BCF_HT_* of an INFO tag
+    };
+    struct Node {
+        int op;
+        int a; // child nodes for && || !, operands otherwise
+        int b;
+    };
+
+private:
+    std::vector<Operand> operands;
+    std::vector<Node> nodes;
+    int root;
+
+    bool eval(int node, bcf1_t *line) const;
+};
+
+#endif
@@ -0,0 +1,374 @@
+#include<Rcpp.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <sys/stat.h>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "htslib/bgzf.h"
+#include "vcf_reader.h"
+#include "vcf_store.h"
+using namespace Rcpp;
+using namespace std;
+
+// an ID index (<vcf>.idi) maps hashed record IDs to the BGZF virtual offsets
+// of their records:
+//   IdIndexHeader, then n_entries IdIndexEntry sorted by hash then offset
+// Hashes can collide, so every record read through it is checked against the
+// ID that was asked for.
+static const char ID_INDEX_MAGIC[8] = {'H', 'T', 'S', 'R', 'I', 'D', 'X', '1'};
+
+struct IdIndexHeader {
+    char magic[8];
+    uint64_t n_entries;
+    uint64_t vcf_size; // to tell an index from an older version of the file
+};
+
+struct IdIndexEntry {
+    uint64_t hash;
+    int64_t offset;
+    bool operator<(const IdIndexEntry& other) const {
+        return hash != other.hash ? hash < other.hash : offset < other.offset;
+    }
+};
+
+// 64-bit FNV-1a
+static uint64_t hash_id(const char *p, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static bool file_size(const std::string& path, uint64_t *size) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) return false;
+    *size = st.st_size;
+    return true;
+}
+
+// call fn(id, len) for every ID in a ;-separated ID column, skipping "."
+template <class F>
+static void for_each_id(const char *ids, size_t len, F fn) {
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && ids[i] != ';') continue;
+        if (i > start && !(i - start == 1 && ids[start] == '.')) fn(ids + start, i - start);
+        start = i + 1;
+    }
+}
+
+struct IdFile {
+    IdFile(const std::string& path, const char *mode = "wb") : fp(fopen(path.c_str(), mode)) {}
+    ~IdFile() { if (fp) fclose(fp); }
+    FILE *fp;
+};
+
+static void write_entries(FILE *fp, const IdIndexEntry *entries, size_t n, const std::string& path) {
+    if (n && fwrite(entries, sizeof(IdIndexEntry), n, fp) != n) stop("couldn't write " + path);
+}
+
+// entries are sorted in memory in runs of this many (16 bytes each, so 1 GB);
+// a file with more IDs is sorted run by run to temporary files next to the
+// index, which are then merged
+static const size_t ID_RUN_ENTRIES = (size_t) 1 << 26;
+
+// the sorted runs of an external sort, removed when it goes out of scope
+struct IdRuns {
+    IdRuns(const std::string& prefix) : prefix(prefix), n_entries(0) {}
+    ~IdRuns() {
+        for (size_t i = 0; i < paths.size(); i++) remove(paths[i].c_str());
+    }
+
+    void add(const IdIndexEntry& entry) {
+        if (entries.size() == ID_RUN_ENTRIES) spill();
+        entries.push_back(entry);
+        n_entries++;
+    }
+
+    // sort the entries in memory and write them out as a run
+    void spill() {
+        std::sort(entries.begin(), entries.end());
+        std::string path = prefix + ".run" + std::to_string(paths.size());
+        paths.push_back(path);
+        IdFile file(path);
+        if (!file.fp) stop("couldn't write " + path);
+        write_entries(file.fp, entries.empty() ? NULL : &entries[0], entries.size(), path);
+        if (fflush(file.fp) != 0) stop("couldn't write " + path);
+        entries.clear();
+    }
+
+    std::string prefix;
+    std::vector<std::string> paths;
+    std::vector<IdIndexEntry> entries; // the run being filled
+    uint64_t n_entries;
+};
+
+struct CollectIds {
+    IdRuns *runs;
+    int64_t offset;
+    void operator()(const char *id, size_t len) const {
+        IdIndexEntry entry = {hash_id(id, len), offset};
+        runs->add(entry);
+    }
+};
+
+// reads a run back in blocks
+class RunReader {
+public:
+    RunReader(const std::string& path) : path(path), file(path, "rb"), at(0), n(0), buf(1 << 16) {
+        if (!file.fp) stop("couldn't read " + path);
+    }
+    bool next(IdIndexEntry *entry) {
+        if (at == n) {
+            n = fread(&buf[0], sizeof(IdIndexEntry), buf.size(), file.fp);
+            at = 0;
+            if (n == 0) {
+                if (ferror(file.fp)) stop("couldn't read " + path);
+                return false;
+            }
+        }
+        *entry = buf[at++];
+        return true;
+    }
+
+private:
+    std::string path;
+    IdFile file;
+    size_t at;
+    size_t n;
+    std::vector<IdIndexEntry> buf;
+};
+
+struct RunHead {
+    IdIndexEntry entry;
+    size_t run;
+    // for a min-heap on entry
+    bool operator<(const RunHead& other) const { return other.entry < entry; }
+};
+
+// k-way merge of the sorted runs into fp
+static void merge_runs(const IdRuns& runs, FILE *fp, const std::string& path) {
+    std::vector<RunReader*> readers;
+    struct Cleanup {
+        std::vector<RunReader*>& readers;
+        ~Cleanup() { for (size_t i = 0; i < readers.size(); i++) delete readers[i]; }
+    } cleanup = {readers};
+
+    std::priority_queue<RunHead> heads;
+    for (size_t r = 0; r < runs.paths.size(); r++) {
+        readers.push_back(new RunReader(runs.paths[r]));
+        RunHead head = {IdIndexEntry(), r};
+        if (readers[r]->next(&head.entry)) heads.push(head);
+    }
+    std::vector<IdIndexEntry> out;
+    out.reserve(1 << 16);
+    while (!heads.empty()) {
+        RunHead head = heads.top();
+        heads.pop();
+        out.push_back(head.entry);
+        if (out.size() == out.capacity()) {
+            write_entries(fp, &out[0], out.size(), path);
+            out.clear();
+        }
+        if (readers[head.run]->next(&head.entry)) heads.push(head);
+    }
+    write_entries(fp, out.empty() ? NULL : &out[0], out.size(), path);
+}
+
+//' build an ID index for looking up VCF records by rsID
+//' @param vcf the bgzipped VCF or BCF file path
+//' @param out where to write the index, by default next to vcf with an .idi suffix
+//' @description Use this function once per file to make find_ids fast. Tabix and CSI indexes only answer
+//' positional queries, so looking records up by ID would otherwise mean scanning the whole file. The file is
+//' streamed once, and every ID of every record (IDs are split on ";") is stored as a 64-bit hash with the
+//' BGZF virtual offset of its record, sorted by hash.
+//' @details The index takes 16 bytes per ID. At most 2^26 IDs (1 GB) are sorted in memory at a time; larger
+//' files are sorted in runs written next to out and merged, which needs as much free disk space again as the
+//' index. The index records the size of vcf, and find_ids refuses to use it once the file has changed.
+//' @return the number of IDs indexed, as a double since it can exceed the range of an integer
+//' @examples
+//' \dontrun{
+//' build_id_index("dbsnp.vcf.gz")
+//' find_ids("dbsnp.vcf.gz", c("rs123", "rs4567"))
+//' }
+// [[Rcpp::export]]
+double build_id_index(std::string vcf, Nullable<CharacterVector> out = R_NilValue) {
+    std::string path = out.isNull() ? vcf + ".idi" : as<std::string>(out.get());
+    VcfSource source = {vcf, ""};
+    VcfReader reader(source);
+    if (!reader.ok()) stop(reader.error);
+    const htsFormat *fmt = hts_get_format(reader.fp);
+    bool is_bcf = fmt->format == bcf;
+    if (!is_bcf && fmt->compression != bgzf) stop("an ID index needs a bgzipped VCF or a BCF");
+
+    // the reader is positioned at the first record; only the ID column is decoded
+    BGZF *bgz = reader.fp->fp.bgzf;
+    IdRuns runs(path);
+    CollectIds collect = {&runs, 0};
+    BcfRecord record;
+    kstring_t line = {0, 0, NULL};
+    int64_t n_records = 0;
+    while (true) {
+        collect.offset = bgzf_tell(bgz);
+        if (is_bcf) {
+            int tid, beg, end;
+            if (bcf_readrec(bgz, NULL, record.line, &tid, &beg, &end) < 0) break;
+            bcf_unpack(record.line, BCF_UN_STR);
+            for_each_id(record.line->d.id, strlen(record.line->d.id), collect);
+        } else {
+            if (hts_getline(reader.fp, '\n', &line) < 0) break;
+            // ID is the third tab-separated column
+            const char *id = line.s;
+            for (int col = 0; col < 2 && id; col++) {
+                id = strchr(id, '\t');
+                if (id) id++;
+            }
+            if (!id) continue;
+            const char *id_end = strchr(id, '\t');
+            for_each_id(id, id_end ? id_end - id : strlen(id), collect);
+        }
+        if (++n_records % 1000000 == 0) checkUserInterrupt();
+    }
+    free(line.s);
+
+    IdIndexHeader header;
+    memcpy(header.magic, ID_INDEX_MAGIC, sizeof(header.magic));
+    header.n_entries = runs.n_entries;
+    if (!file_size(vcf, &header.vcf_size)) stop("couldn't stat " + vcf);
+    IdFile file(path);
+    if (!file.fp) stop("couldn't write " + path);
+    if (fwrite(&header, sizeof(header), 1, file.fp) != 1) stop("couldn't write " + path);
+    if (runs.paths.empty()) {
+        std::sort(runs.entries.begin(), runs.entries.end());
+        write_entries(file.fp, runs.entries.empty() ? NULL : &runs.entries[0], runs.entries.size(), path);
+    } else {
+        if (!runs.entries.empty()) runs.spill();
+        std::vector<IdIndexEntry>().swap(runs.entries);
+        Rprintf("merging %d sorted runs\n", (int) runs.paths.size());
+        merge_runs(runs, file.fp, path);
+    }
+    if (fflush(file.fp) != 0) stop("couldn't write " + path);
+    Rprintf("indexed %.0f IDs in %.0f records\n", (double) runs.n_entries, (double) n_records);
+    return runs.n_entries;
+}
+
+// read the one record starting at a virtual offset
+static int read_record_at(VcfReader& reader, int64_t offset, bcf1_t *line, kstring_t *s) {
+    if (bgzf_seek(reader.fp->fp.bgzf, offset, SEEK_SET) < 0) return -2;
+    if (hts_get_format(reader.fp)->format == bcf) return bcf_read(reader.fp, reader.hdr, line);
+    if (hts_getline(reader.fp, '\n', s) < 0) return -2;
+    return vcf_parse(s, reader.hdr, line);
+}
+
+struct MatchId {
+    const char *wanted;
+    size_t len;
+    bool *found;
+    void operator()(const char *id, size_t n) const {
+        if (n == len && memcmp(id, wanted, n) == 0) *found = true;
+    }
+};
+
+//' look up VCF records by ID through an ID index
+//' @param vcf the bgzipped VCF or BCF file path
+//' @param ids a character vector of IDs, e.g. rsIDs
+//' @param index the ID index written by build_id_index, by default next to vcf with an .idi suffix
+//' @description Use this function to fetch records by ID without scanning the file. Each ID is found by binary
+//' search in the memory-mapped index, and its records are read by seeking straight to their BGZF offsets, in
+//' file order so that neighbouring records share decompressed blocks.
+//' @details Every record is checked against the ID asked for, so hash collisions never produce false matches.
+//' An ID found in several records gives one row per record.
+//' @return a dataframe with one row per match: query (the 1-based index into ids), chrom, pos, id (the record's
+//' whole ID column), ref and alt (comma-separated). IDs that weren't found have no rows.
+//' @examples
+//' \dontrun{find_ids("dbsnp.vcf.gz", c("rs123", "rs4567"))}
+// [[Rcpp::export]]
+DataFrame find_ids(std::string vcf, std::vector<std::string> ids, Nullable<CharacterVector> index = R_NilValue) {
+    std::string path = index.isNull() ? vcf + ".idi" : as<std::string>(index.get());
+    MappedFile file;
+    if (!file.open(path) || file.size < sizeof(IdIndexHeader)) stop("couldn't read ID index " + path);
+    const IdIndexHeader *header = (const IdIndexHeader *) file.data;
+    if (memcmp(header->magic, ID_INDEX_MAGIC, sizeof(ID_INDEX_MAGIC)) != 0) stop(path + " is not an ID index");
+    if (file.size < sizeof(IdIndexHeader) + header->n_entries * sizeof(IdIndexEntry)) stop(path + " is truncated");
+    uint64_t vcf_size;
+    if (!file_size(vcf, &vcf_size)) stop("couldn't stat " + vcf);
+    if (vcf_size != header->vcf_size) stop(path + " is out of date, rebuild it with build_id_index");
+    const IdIndexEntry *first = (const IdIndexEntry *) (header + 1);
+    const IdIndexEntry *last = first + header->n_entries;
+
+    // every (offset, query) candidate, then read in file order
+    std::vector<std::pair<int64_t, int> > candidates;
+    for (size_t q = 0; q < ids.size(); q++) {
+        IdIndexEntry key = {hash_id(ids[q].c_str(), ids[q].size()), INT64_MIN};
+        for (const IdIndexEntry *e = std::lower_bound(first, last, key); e < last && e->hash == key.hash; e++) {
+            candidates.push_back(std::make_pair(e->offset, (int) q));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    VcfSource source = {vcf, ""};
+    VcfReader reader(source);
+    if (!reader.ok()) stop(reader.error);
+    BcfRecord record;
+    bcf1_t *line = record.line;
+    kstring_t s = {0, 0, NULL};
+
+    std::vector<std::pair<int, int64_t> > matches; // (query, candidate), sorted into query order below
+    std::vector<std::string> chroms, record_ids, refs, alts;
+    std::vector<int> positions;
+    int64_t loaded = -1;
+    for (size_t c = 0; c < candidates.size(); c++) {
+        if (candidates[c].first != loaded) {
+            if (read_record_at(reader, candidates[c].first, line, &s) < 0) {
+                free(s.s);
+                stop("couldn't read the record at an indexed offset; is the ID index for this file?");
+            }
+            bcf_unpack(line, BCF_UN_STR);
+            loaded = candidates[c].first;
+        }
+        const std::string& wanted = ids[candidates[c].second];
+        bool found = false;
+        MatchId match = {wanted.c_str(), wanted.size(), &found};
+        for_each_id(line->d.id, strlen(line->d.id), match);
+        if (!found) continue; // a hash collision
+
+        matches.push_back(std::make_pair(candidates[c].second, (int64_t) positions.size()));
+        chroms.push_back(bcf_hdr_id2name(reader.hdr, line->rid));
+        positions.push_back(line->pos);
+        record_ids.push_back(line->d.id);
+        refs.push_back(line->d.allele[0]);
+        std::string alt;
+        for (int a = 1; a < line->n_allele; a++) {
+            if (a > 1) alt += ",";
+            alt += line->d.allele[a];
+        }
+        alts.push_back(alt);
+    }
+    free(s.s);
+    std::sort(matches.begin(), matches.end());
+
+    size_t n = matches.size();
+    IntegerVector query(n), pos(n);
+    CharacterVector chrom(n), id(n), ref(n), alt(n);
+    for (size_t i = 0; i < n; i++) {
+        size_t m = matches[i].second;
+        query[i] = matches[i].first + 1;
+        chrom[i] = chroms[m];
+        pos[i] = positions[m];
+        id[i] = record_ids[m];
+        ref[i] = refs[m];
+        alt[i] = alts[m];
+    }
+    return DataFrame::create(
+        Named("query") = query,
+        Named("chrom") = chrom,
+        Named("pos") = pos,
+        Named("id") = id,
+        Named("ref") = ref,
+        Named("alt") = alt
+    );
+}
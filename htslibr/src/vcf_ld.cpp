@@ -0,0 +1,272 @@
+#include<Rcpp.h>
+#include <cmath>
+#include <stdint.h>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+static inline int popcount64(uint64_t x) {
+    return __builtin_popcountll(x);
+}
+
+// packs each variant into two bitsets over haplotypes: the non-reference
+// alleles and the missing calls. Bits past the last haplotype are marked
+// missing so the masked kernel never counts them.
+class HaplotypeBitsKernel : public VcfKernel {
+public:
+    HaplotypeBitsKernel(int n_samples)
+        : n_samples(n_samples), n_haps(2 * n_samples), n_words((2 * n_samples + 63) / 64), gt_arr(NULL), ngt_arr(0) {}
+    HaplotypeBitsKernel(const HaplotypeBitsKernel& other)
+        : n_samples(other.n_samples), n_haps(other.n_haps), n_words(other.n_words), gt_arr(NULL), ngt_arr(0) {}
+    ~HaplotypeBitsKernel() { free(gt_arr); }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        int ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
+        int max_ploidy = ngt > 0 && n_samples > 0 ? ngt / n_samples : 0;
+
+        size_t base = alt.size();
+        alt.resize(base + n_words, 0);
+        missing.resize(base + n_words, 0);
+        uint64_t *h = &alt[base];
+        uint64_t *m = &missing[base];
+        for (int hap = n_haps; hap < n_words * 64; hap++) m[hap >> 6] |= 1ULL << (hap & 63);
+
+        int n_missing = 0;
+        for (int i = 0; i < n_samples; i++) {
+            for (int j = 0; j < 2; j++) {
+                int hap = 2 * i + j;
+                int32_t g = j < max_ploidy ? gt_arr[i * max_ploidy + j] : bcf_int32_vector_end;
+                if (g == bcf_int32_vector_end || bcf_gt_is_missing(g)) {
+                    m[hap >> 6] |= 1ULL << (hap & 63);
+                    n_missing++;
+                } else if (bcf_gt_allele(g) != 0) {
+                    h[hap >> 6] |= 1ULL << (hap & 63);
+                }
+            }
+        }
+
+        int ac = 0;
+        for (int w = 0; w < n_words; w++) ac += popcount64(h[w]);
+        rids.push_back(line->rid);
+        positions.push_back(line->pos);
+        alt_counts.push_back(ac);
+        complete.push_back(n_missing == 0);
+        return true;
+    }
+
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        alt.reserve(n_records * n_words);
+        missing.reserve(n_records * n_words);
+        rids.reserve(n_records);
+        positions.reserve(n_records);
+        alt_counts.reserve(n_records);
+        complete.reserve(n_records);
+    }
+
+    int n_samples;
+    int n_haps;
+    int n_words;
+    std::vector<uint64_t> alt;
+    std::vector<uint64_t> missing;
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<int> alt_counts;
+    std::vector<char> complete;
+
+private:
+    int32_t *gt_arr;
+    int ngt_arr;
+};
+
+// all variants of the region, bit-packed back to back
+struct LdInput {
+    int n_haps;
+    int n_words;
+    int n_variants;
+    std::vector<uint64_t> alt;
+    std::vector<uint64_t> missing;
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<int> alt_counts;
+    std::vector<char> complete;
+
+    int window;
+    int max_dist;
+    double min_r2;
+    int n_tasks;
+};
+
+struct LdPairs {
+    std::vector<int> i;
+    std::vector<int> j;
+    std::vector<double> r2;
+    std::vector<double> dprime;
+};
+
+struct LdScan {
+    const LdInput *input;
+    std::vector<LdPairs> *pairs;
+};
+
+static void ld_pair(const LdInput& in, int i, int j, double& r2, double& dprime) {
+    const uint64_t *hi = &in.alt[(size_t) i * in.n_words];
+    const uint64_t *hj = &in.alt[(size_t) j * in.n_words];
+    int n, a, b, ab = 0;
+    if (in.complete[i] && in.complete[j]) {
+        n = in.n_haps;
+        a = in.alt_counts[i];
+        b = in.alt_counts[j];
+        for (int w = 0; w < in.n_words; w++) ab += popcount64(hi[w] & hj[w]);
+    } else {
+        // only haplotypes called at both sites take part
+        const uint64_t *mi = &in.missing[(size_t) i * in.n_words];
+        const uint64_t *mj = &in.missing[(size_t) j * in.n_words];
+        n = a = b = 0;
+        for (int w = 0; w < in.n_words; w++) {
+            uint64_t valid = ~(mi[w] | mj[w]);
+            n += popcount64(valid);
+            a += popcount64(hi[w] & valid);
+            b += popcount64(hj[w] & valid);
+            ab += popcount64(hi[w] & hj[w] & valid);
+        }
+    }
+
+    r2 = dprime = NA_REAL;
+    if (n == 0) return;
+    double p_a = (double) a / n, p_b = (double) b / n;
+    double var = p_a * (1 - p_a) * p_b * (1 - p_b);
+    if (var <= 0) return; // monomorphic at one of the sites
+    double d = (double) ab / n - p_a * p_b;
+    r2 = d * d / var;
+    double d_max = d >= 0 ? std::min(p_a * (1 - p_b), (1 - p_a) * p_b) : std::min(p_a * p_b, (1 - p_a) * (1 - p_b));
+    dprime = std::fabs(d) / d_max;
+}
+
+// each task takes an interleaved slice of the first variant of each pair, so
+// that the shrinking windows at the end of a contig are spread across threads
+static void ld_task(void *arg, int task) {
+    LdScan *scan = (LdScan *) arg;
+    const LdInput& in = *scan->input;
+    LdPairs& out = (*scan->pairs)[task];
+    const int block = 64;
+    for (int start = task * block; start < in.n_variants; start += in.n_tasks * block) {
+        int stop_i = std::min(start + block, in.n_variants);
+        for (int i = start; i < stop_i; i++) {
+            int last = in.window > 0 ? std::min(in.n_variants - 1, i + in.window) : in.n_variants - 1;
+            for (int j = i + 1; j <= last; j++) {
+                if (in.rids[j] != in.rids[i]) break;
+                if (in.max_dist > 0 && in.positions[j] - in.positions[i] > in.max_dist) break;
+                double r2, dprime;
+                ld_pair(in, i, j, r2, dprime);
+                if (in.min_r2 > 0 && !(r2 >= in.min_r2)) continue;
+                out.i.push_back(i + 1);
+                out.j.push_back(j + 1);
+                out.r2.push_back(r2);
+                out.dprime.push_back(dprime);
+            }
+        }
+    }
+}
+
+//' compute pairwise linkage disequilibrium (r2 and D') within a sliding window
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param window the maximum number of variants between the two sites of a pair. Use 0 for no limit.
+//' @param max_dist the maximum distance in bp between the two sites of a pair. Use 0 for no limit.
+//' @param min_r2 only report pairs with r2 at least this large. Use 0 to report every pair.
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads, used both for reading the region and for the pairwise kernel
+//' @description Use this function to compute LD without extracting the genotype matrix. Each variant is
+//' bit-packed into 64-bit words over haplotypes (one bit for the non-reference allele and one for a
+//' missing call), and each pair is computed with popcounts of the word-wise AND.
+//' @details Haplotypes are taken in the order they are stored, as in extract_genotypes, so phased data gives
+//' haplotype r2 and D'. All non-reference alleles are pooled. Haplotypes missing at either site are dropped
+//' from that pair. Pairs involving a site that is monomorphic among the remaining haplotypes have NA r2.
+//' D' is reported as its absolute value.
+//' @return a list with variants, a dataframe with the chrom and pos of each variant, and pairs, a sparse
+//' (triplet) dataframe with the 1-based variant indices i and j, r2 and dprime of each pair
+//' @examples
+//' \dontrun{ld_window(vcf, index, "1:10001-500000", window = 200, max_dist = 100000, min_r2 = 0.2)}
+// [[Rcpp::export]]
+List ld_window(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, int window = 100, int max_dist = 0,
+               double min_r2 = 0, Nullable<CharacterVector> samples = R_NilValue, int threads = 1) {
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    int n_samples = bcf_hdr_nsamples(reader.hdr);
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    std::vector<HaplotypeBitsKernel> kernels(shards.size(), HaplotypeBitsKernel(n_samples));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    LdInput in;
+    in.n_haps = 2 * n_samples;
+    in.n_words = (in.n_haps + 63) / 64;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        HaplotypeBitsKernel& kernel = kernels[k];
+        in.alt.insert(in.alt.end(), kernel.alt.begin(), kernel.alt.end());
+        in.missing.insert(in.missing.end(), kernel.missing.begin(), kernel.missing.end());
+        in.rids.insert(in.rids.end(), kernel.rids.begin(), kernel.rids.end());
+        in.positions.insert(in.positions.end(), kernel.positions.begin(), kernel.positions.end());
+        in.alt_counts.insert(in.alt_counts.end(), kernel.alt_counts.begin(), kernel.alt_counts.end());
+        in.complete.insert(in.complete.end(), kernel.complete.begin(), kernel.complete.end());
+        std::vector<uint64_t>().swap(kernel.alt);
+        std::vector<uint64_t>().swap(kernel.missing);
+    }
+    in.n_variants = in.rids.size();
+    in.window = window;
+    in.max_dist = max_dist;
+    in.min_r2 = min_r2;
+    in.n_tasks = std::max(1, threads);
+
+    std::vector<LdPairs> pairs(in.n_tasks);
+    LdScan scan = {&in, &pairs};
+    parallel_for(in.n_tasks, threads, ld_task, &scan);
+
+    // tasks interleave blocks of i, so order the pairs by (i, j) on the way out
+    size_t n_pairs = 0;
+    for (size_t t = 0; t < pairs.size(); t++) n_pairs += pairs[t].i.size();
+    IntegerVector out_i(n_pairs), out_j(n_pairs);
+    NumericVector out_r2(n_pairs), out_dprime(n_pairs);
+    std::vector<size_t> cursor(pairs.size(), 0);
+    size_t row = 0;
+    const int block = 64;
+    for (int start = 0; start < in.n_variants; start += block) {
+        LdPairs& p = pairs[(start / block) % in.n_tasks];
+        size_t& c = cursor[(start / block) % in.n_tasks];
+        while (c < p.i.size() && p.i[c] <= start + block) {
+            out_i[row] = p.i[c];
+            out_j[row] = p.j[c];
+            out_r2[row] = p.r2[c];
+            out_dprime[row] = p.dprime[c];
+            c++;
+            row++;
+        }
+    }
+
+    CharacterVector chroms(in.n_variants);
+    IntegerVector positions(in.n_variants);
+    for (int v = 0; v < in.n_variants; v++) {
+        chroms[v] = bcf_hdr_id2name(reader.hdr, in.rids[v]);
+        positions[v] = in.positions[v];
+    }
+
+    return List::create(
+        Named("variants") = DataFrame::create(
+            Named("chrom") = chroms,
+            Named("pos") = positions
+        ),
+        Named("pairs") = DataFrame::create(
+            Named("i") = out_i,
+            Named("j") = out_j,
+            Named("r2") = out_r2,
+            Named("dprime") = out_dprime
+        )
+    );
+}
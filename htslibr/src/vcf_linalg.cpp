@@ -0,0 +1,394 @@
+#include<Rcpp.h>
+#include <cmath>
+#include <stdint.h>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+// turns one record's GT field into mean-centered, variance-scaled dosages
+// (number of non-reference alleles). Missing calls are mean-imputed, i.e. 0.
+class DosageStandardizer {
+public:
+    DosageStandardizer() : gt_arr(NULL), ngt_arr(0) {}
+    ~DosageStandardizer() { free(gt_arr); }
+
+    // writes sample i to out[i * stride]; returns false (and writes nothing)
+    // for sites that are monomorphic or have no calls
+    template <class T>
+    bool apply(bcf_hdr_t *hdr, bcf1_t *line, T *out, size_t stride) {
+        int n_samples = bcf_hdr_nsamples(hdr);
+        int ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
+        if (ngt <= 0 || n_samples == 0) return false;
+        int max_ploidy = ngt / n_samples;
+
+        dosages.resize(n_samples);
+        int n_called = 0, n_alleles = 0, sum = 0;
+        for (int i = 0; i < n_samples; i++) {
+            const int32_t *ptr = gt_arr + i * max_ploidy;
+            int g = 0, ploidy = 0;
+            for (int j = 0; j < max_ploidy; j++) {
+                if (ptr[j] == bcf_int32_vector_end) break;
+                if (bcf_gt_is_missing(ptr[j])) {
+                    ploidy = 0;
+                    break;
+                }
+                g += bcf_gt_allele(ptr[j]) != 0;
+                ploidy++;
+            }
+            dosages[i] = ploidy ? g : -1;
+            if (ploidy) {
+                n_called++;
+                n_alleles += ploidy;
+                sum += g;
+            }
+        }
+        if (n_called == 0) return false;
+
+        // scale by the binomial sd of the (average) ploidy at the site's allele frequency
+        double p = (double) sum / n_alleles;
+        double mean = (double) sum / n_called;
+        double sd = std::sqrt((double) n_alleles / n_called * p * (1 - p));
+        if (!(sd > 0)) return false;
+        for (int i = 0; i < n_samples; i++) {
+            out[i * stride] = dosages[i] < 0 ? 0 : (T) ((dosages[i] - mean) / sd);
+        }
+        return true;
+    }
+
+private:
+    int32_t *gt_arr;
+    int ngt_arr;
+    std::vector<int> dosages;
+};
+
+// G += Z^T Z for one block, where Z is stored sample-major (stride floats per
+// sample, width of them used). Only the lower triangle of the column-major
+// n x n matrix G is updated; tasks own interleaved rows of 64 x 64 tiles, so
+// no two tasks write the same element.
+struct GrmBlock {
+    const float *z;
+    int n;
+    int width;
+    int stride;
+    double *g;
+    int n_tasks;
+};
+
+static void grm_task(void *arg, int task) {
+    const GrmBlock& block = *(GrmBlock *) arg;
+    const int tile = 64;
+    int n_tiles = (block.n + tile - 1) / tile;
+    for (int ti = task; ti < n_tiles; ti += block.n_tasks) {
+        int a_end = std::min(block.n, (ti + 1) * tile);
+        for (int tj = 0; tj <= ti; tj++) {
+            int b_end = std::min(block.n, (tj + 1) * tile);
+            for (int a = ti * tile; a < a_end; a++) {
+                const float *za = block.z + (size_t) a * block.stride;
+                double *g_row = block.g + a;
+                for (int b = tj * tile; b < b_end && b <= a; b++) {
+                    const float *zb = block.z + (size_t) b * block.stride;
+                    float s = 0;
+                    for (int v = 0; v < block.width; v++) s += za[v] * zb[v];
+                    g_row[(size_t) b * block.n] += s;
+                }
+            }
+        }
+    }
+}
+
+//' build a genetic relationship (GRM) matrix from the GT field
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path
+//' @param reg one or more region queries of the form: chr:start-end, read in order
+//' @param block_size the number of variants standardized and accumulated at a time
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads, used for BGZF decompression and for the blocked product
+//' @description Use this function to compute a samples x samples GRM without extracting the genotype
+//' matrix. Variants are streamed through the reader, standardized into a block of block_size x samples
+//' floats, and the block's symmetric product is added to the GRM with a tiled, multithreaded kernel.
+//' Apart from the result, memory is bounded by block_size x samples.
+//' @details Each variant's non-reference allele count is centered on its mean and scaled by
+//' sqrt(ploidy * p * (1 - p)). Missing calls are mean-imputed and monomorphic sites are skipped.
+//' The sum is divided by the number of variants used, which is attached as the n_variants attribute.
+//' @return a symmetric numeric matrix with the sample names as dimnames
+//' @examples
+//' \dontrun{grm(vcf, index, c("1:10001-5000000", "2:10001-5000000"), threads = 8)}
+// [[Rcpp::export]]
+NumericMatrix grm(std::string vcf, std::string index, std::vector<std::string> reg, int block_size = 256,
+                  Nullable<CharacterVector> samples = R_NilValue, int threads = 1) {
+    VcfSource source = {vcf, index};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+    reader.set_threads(threads);
+    if (block_size < 1) stop("block_size must be positive");
+
+    int n = bcf_hdr_nsamples(reader.hdr);
+    NumericMatrix out(n, n);
+    std::vector<float> z((size_t) n * block_size);
+    GrmBlock block = {&z[0], n, 0, block_size, out.begin(), std::max(1, threads)};
+
+    // one pool for the whole scan; a block takes milliseconds, far less than starting threads
+    TaskPool pool(block.n_tasks);
+    DosageStandardizer standardizer;
+    BcfRecord record;
+    int n_variants = 0;
+    for (size_t r = 0; r < reg.size(); r++) {
+        if (!reader.query(reg[r])) stop(reader.error);
+        int ret;
+        while ((ret = reader.next(record.line)) >= 0) {
+            if (!standardizer.apply(reader.hdr, record.line, &z[block.width], block_size)) continue;
+            n_variants++;
+            if (++block.width == block_size) {
+                pool.run(block.n_tasks, grm_task, &block);
+                block.width = 0;
+                checkUserInterrupt();
+            }
+        }
+        if (ret < -1) stop(reader.error);
+    }
+    if (block.width > 0) pool.run(block.n_tasks, grm_task, &block);
+
+    for (int b = 0; b < n; b++) {
+        for (int a = b; a < n; a++) {
+            double g = n_variants ? out(a, b) / n_variants : NA_REAL;
+            out(a, b) = g;
+            out(b, a) = g;
+        }
+    }
+
+    CharacterVector sample_names(n);
+    for (int i = 0; i < n; i++) sample_names[i] = reader.hdr->samples[i];
+    out.attr("dimnames") = List::create(sample_names, sample_names);
+    out.attr("n_variants") = n_variants;
+    return out;
+}
+
+// pulls standardized variants from a list of regions, block_size at a time,
+// on a single file handle. rewind() starts over for the next power iteration.
+class GenotypeBlockReader {
+public:
+    GenotypeBlockReader(const VcfSource& source, const std::vector<std::string>& regions, int block_size, int threads)
+        : reader(source, true), regions(regions), block_size(block_size), next_region(0), in_region(false) {
+        if (!reader.ok()) stop(reader.error);
+        if (block_size < 1) stop("block_size must be positive");
+        reader.set_threads(threads);
+        n_samples = bcf_hdr_nsamples(reader.hdr);
+        z.resize((size_t) n_samples * block_size);
+    }
+
+    void rewind() {
+        next_region = 0;
+        in_region = false;
+    }
+
+    // fills z with up to block_size column-major samples x variants columns and
+    // returns how many; 0 once every region has been read
+    int fill() {
+        rids.clear();
+        positions.clear();
+        int width = 0;
+        while (width < block_size && next(record.line)) {
+            if (!standardizer.apply(reader.hdr, record.line, &z[(size_t) width * n_samples], 1)) continue;
+            rids.push_back(record.line->rid);
+            positions.push_back(record.line->pos);
+            width++;
+        }
+        return width;
+    }
+
+    VcfReader reader;
+    int n_samples;
+    std::vector<double> z;
+    std::vector<int> rids;
+    std::vector<int> positions;
+
+private:
+    bool next(bcf1_t *line) {
+        while (true) {
+            if (!in_region) {
+                if (next_region >= regions.size()) return false;
+                if (!reader.query(regions[next_region++])) stop(reader.error);
+                in_region = true;
+            }
+            int ret = reader.next(line);
+            if (ret >= 0) return true;
+            if (ret < -1) stop(reader.error);
+            in_region = false;
+        }
+    }
+
+    std::vector<std::string> regions;
+    int block_size;
+    size_t next_region;
+    bool in_region;
+    DosageStandardizer standardizer;
+    BcfRecord record;
+};
+
+//' open a stream of standardized genotype blocks, e.g. for out-of-core PCA
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path
+//' @param reg one or more region queries of the form: chr:start-end, read in order
+//' @param block_size the maximum number of variants per block
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads used for BGZF decompression
+//' @description Use this function with next_genotype_block to walk a VCF/BCF as a sequence of
+//' mean-centered, variance-scaled genotype blocks, so that only one block is ever held in memory.
+//' Call rewind_genotype_blocks to re-read the file, e.g. once per power iteration of a randomized SVD.
+//' @details Variants are standardized as in grm: non-reference allele counts are centered on their mean and
+//' scaled by sqrt(ploidy * p * (1 - p)), missing calls are mean-imputed and monomorphic sites are skipped.
+//' @return an external pointer to the block reader
+//' @examples
+//' \dontrun{
+//' blocks <- genotype_blocks(vcf, index, c("1:10001-5000000", "2:10001-5000000"), block_size = 2000)
+//' while (!is.null(z <- next_genotype_block(blocks))) print(dim(z))
+//' }
+// [[Rcpp::export]]
+SEXP genotype_blocks(std::string vcf, std::string index, std::vector<std::string> reg, int block_size = 1000,
+                     Nullable<CharacterVector> samples = R_NilValue, int threads = 1) {
+    VcfSource source = {vcf, index};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    return XPtr<GenotypeBlockReader>(new GenotypeBlockReader(source, reg, block_size, threads), true);
+}
+
+//' read the next block from a stream opened with genotype_blocks
+//' @param blocks the external pointer returned by genotype_blocks
+//' @return a column-major numeric matrix of standardized genotypes (samples x variants in the block),
+//' with the chrom and pos of its variants as attributes, or NULL once the regions are exhausted
+// [[Rcpp::export]]
+SEXP next_genotype_block(SEXP blocks) {
+    XPtr<GenotypeBlockReader> ptr(blocks);
+    int width = ptr->fill();
+    if (width == 0) return R_NilValue;
+
+    int n = ptr->n_samples;
+    NumericMatrix out(n, width);
+    std::copy(ptr->z.begin(), ptr->z.begin() + (size_t) n * width, out.begin());
+
+    CharacterVector chroms(width);
+    for (int v = 0; v < width; v++) chroms[v] = bcf_hdr_id2name(ptr->reader.hdr, ptr->rids[v]);
+    CharacterVector sample_names(n);
+    for (int i = 0; i < n; i++) sample_names[i] = ptr->reader.hdr->samples[i];
+    out.attr("dimnames") = List::create(sample_names, R_NilValue);
+    out.attr("chrom") = chroms;
+    out.attr("pos") = IntegerVector(ptr->positions.begin(), ptr->positions.end());
+    return out;
+}
+
+//' restart a stream opened with genotype_blocks from its first region
+//' @param blocks the external pointer returned by genotype_blocks
+// [[Rcpp::export]]
+void rewind_genotype_blocks(SEXP blocks) {
+    XPtr<GenotypeBlockReader> ptr(blocks);
+    ptr->rewind();
+}
+
+// one block of Z %*% x (tasks own sample rows) or t(Z) %*% x (tasks own variants)
+struct MatvecBlock {
+    const double *z;
+    int n;
+    int width;
+    const double *x;
+    int x_rows;
+    int k;
+    int v0;
+    bool transpose;
+    double *out; // n x k, or width x k when transposed
+    int n_tasks;
+};
+
+static void matvec_task(void *arg, int task) {
+    const MatvecBlock& b = *(MatvecBlock *) arg;
+    if (!b.transpose) {
+        for (int i = task; i < b.n; i += b.n_tasks) {
+            for (int c = 0; c < b.k; c++) {
+                const double *x = b.x + (size_t) c * b.x_rows + b.v0;
+                double s = 0;
+                for (int v = 0; v < b.width; v++) s += b.z[i + (size_t) v * b.n] * x[v];
+                b.out[i + (size_t) c * b.n] += s;
+            }
+        }
+    } else {
+        for (int v = task; v < b.width; v += b.n_tasks) {
+            const double *z = b.z + (size_t) v * b.n;
+            for (int c = 0; c < b.k; c++) {
+                const double *x = b.x + (size_t) c * b.x_rows;
+                double s = 0;
+                for (int i = 0; i < b.n; i++) s += z[i] * x[i];
+                b.out[v + (size_t) c * b.width] = s;
+            }
+        }
+    }
+}
+
+//' multiply the standardized genotype matrix by a matrix without holding it in memory
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path
+//' @param reg one or more region queries of the form: chr:start-end, read in order
+//' @param x a numeric matrix (use as.matrix for a vector). Variants x k, or samples x k when transpose is TRUE.
+//' @param transpose compute t(Z) \%*\% x instead of Z \%*\% x
+//' @param block_size the number of variants standardized at a time
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads, used for BGZF decompression and for the product
+//' @description Use this function for the products of a randomized SVD/PCA, where Z is the samples x variants
+//' matrix of standardized genotypes that genotype_blocks yields. The file is streamed once per call and only
+//' one block of Z is in memory at a time.
+//' @return a numeric matrix: samples x k for Z \%*\% x, or variants x k for t(Z) \%*\% x
+//' @examples
+//' \dontrun{
+//' omega <- matrix(rnorm(n_samples * 10), n_samples, 10)
+//' y <- genotype_matvec(vcf, index, reg, omega, transpose = TRUE)
+//' }
+// [[Rcpp::export]]
+NumericMatrix genotype_matvec(std::string vcf, std::string index, std::vector<std::string> reg, NumericMatrix x,
+                              bool transpose = false, int block_size = 1000,
+                              Nullable<CharacterVector> samples = R_NilValue, int threads = 1) {
+    VcfSource source = {vcf, index};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    GenotypeBlockReader blocks(source, reg, block_size, threads);
+
+    int n = blocks.n_samples;
+    int k = x.ncol();
+    if (transpose && x.nrow() != n) stop("x has %d rows but there are %d samples", x.nrow(), n);
+
+    MatvecBlock b = {NULL, n, 0, x.begin(), x.nrow(), k, 0, transpose, NULL, std::max(1, threads)};
+    std::vector<double> sums;     // Z %*% x, n x k
+    std::vector<double> block_out; // t(Z) %*% x for one block
+    std::vector<double> rows;     // t(Z) %*% x, variant-major so blocks can be appended
+    if (!transpose) sums.assign((size_t) n * k, 0.0);
+
+    TaskPool pool(b.n_tasks);
+    while ((b.width = blocks.fill()) > 0) {
+        b.z = &blocks.z[0];
+        if (!transpose) {
+            if (b.v0 + b.width > x.nrow()) stop("x has %d rows but there are more variants", x.nrow());
+            b.out = &sums[0];
+        } else {
+            block_out.assign((size_t) b.width * k, 0.0);
+            b.out = &block_out[0];
+        }
+        pool.run(b.n_tasks, matvec_task, &b);
+        if (transpose) {
+            for (int v = 0; v < b.width; v++) {
+                for (int c = 0; c < k; c++) rows.push_back(block_out[v + (size_t) c * b.width]);
+            }
+        }
+        b.v0 += b.width;
+        checkUserInterrupt();
+    }
+
+    if (!transpose) {
+        if (b.v0 != x.nrow()) stop("x has %d rows but %d variants were used", x.nrow(), b.v0);
+        NumericMatrix out(n, k);
+        std::copy(sums.begin(), sums.end(), out.begin());
+        return out;
+    }
+    NumericMatrix out(b.v0, k);
+    for (int v = 0; v < b.v0; v++) {
+        for (int c = 0; c < k; c++) out(v, c) = rows[(size_t) v * k + c];
+    }
+    return out;
+}
@@ -0,0 +1,709 @@
+#include<Rcpp.h>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include "htslib/hts.h"
+#include "htslib/bgzf.h"
+#include "htslib/vcf.h"
+#include "htslib/tbx.h"
+#include "htslib/thread_pool.h"
+#include "htslib/regidx.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+VcfReader::VcfReader(const VcfSource& source, bool verbose)
+    : fp(NULL), hdr(NULL), use_csi(false), csi_idx(NULL), tbi_idx(NULL), itr(NULL),
+      streaming(false), stream_started(false), header_end(-1),
+      pool(NULL), queue(NULL), n_threads(1), full_hdr(NULL), parse_hdrs_size(0), batch_size(0), batch_at(0), batch_status(0) {
+    s.l = s.m = 0; s.s = NULL; // needs to be initialized to prevent segfault
+
+    fp = hts_open(source.vcf.c_str(), "r");
+    if (!fp) {
+        error = "couldn't read vcf " + source.vcf;
+        return;
+    }
+    if (verbose) {
+        char *description = hts_format_description(hts_get_format(fp));
+        Rcout << "detecting format " << description << endl;
+        free(description);
+    }
+    if (source.index.empty()) {
+        // no index, so the file can only be streamed: BCF through the binary path, VCF through the text path
+        use_csi = hts_get_format(fp)->format == bcf;
+        if (verbose) Rcout << "no index, streaming the whole file" << endl;
+    } else {
+        if (source.index.find("csi") != std::string::npos) {
+            use_csi = true;
+            if (verbose) Rcout << "using csi index" << endl;
+        }
+        if (use_csi) {
+            csi_idx = bcf_index_load2(source.vcf.c_str(), source.index.c_str());
+            if (!csi_idx) {
+                error = "csi index is null";
+                return;
+            }
+        } else {
+            tbi_idx = tbx_index_load2(source.vcf.c_str(), source.index.c_str());
+            if (!tbi_idx) {
+                error = "tbi index is null";
+                return;
+            }
+        }
+    }
+
+    hdr = bcf_hdr_read(fp);
+    if (!hdr) {
+        error = "can't read header for vcf " + source.vcf;
+        return;
+    }
+    // the contigs with records in the index. CSI ids are the header's contig
+    // ids, while TBI indexes keep their own names.
+    std::vector<std::string> contigs = indexed_contigs();
+    for (size_t i = 0; i < contigs.size(); i++) {
+        const char *name = contigs[i].c_str();
+        indexed_ids[contigs[i]] = use_csi ? bcf_hdr_name2id(hdr, name) : tbx_name2id(tbi_idx, name);
+    }
+
+    // remember where the records start so a stream can be restarted. Only BGZF
+    // can seek: plain-text and plain-gzip files are streamed once.
+    if (hts_get_format(fp)->compression == bgzf) header_end = bgzf_tell(fp->fp.bgzf);
+
+    // restricting the header makes vcf_parse/bcf_unpack skip the other samples entirely
+    if (!source.samples.empty()) {
+        for (size_t i = 0; i < source.samples.size(); i++) {
+            if (i) sample_list += ",";
+            sample_list += source.samples[i];
+        }
+        if (!use_csi) full_hdr = bcf_hdr_dup(hdr); // for set_threads' parse jobs
+        int ret = bcf_hdr_set_samples(hdr, sample_list.c_str(), 0);
+        if (ret < 0) {
+            error = "couldn't subset samples";
+        } else if (ret > 0) {
+            error = "sample " + source.samples[ret - 1] + " not found in the header";
+        }
+    }
+
+    if (!source.filter.empty() && !filter.compile(hdr, source.filter, error)) error = "invalid filter: " + error;
+}
+
+VcfReader::~VcfReader() {
+    free(s.s);
+    for (size_t i = 0; i < batch_lines.size(); i++) free(batch_lines[i].s);
+    for (size_t i = 0; i < batch_records.size(); i++) bcf_destroy(batch_records[i]);
+    for (size_t i = 0; i < parse_hdrs.size(); i++) bcf_hdr_destroy(parse_hdrs[i]);
+    if (full_hdr) bcf_hdr_destroy(full_hdr);
+    if (itr) hts_itr_destroy(itr);
+    if (csi_idx) hts_idx_destroy(csi_idx);
+    if (tbi_idx) tbx_destroy(tbi_idx);
+    if (hdr) bcf_hdr_destroy(hdr);
+    if (fp) hts_close(fp);
+    // the file may still be using the pool until it is closed
+    if (queue) hts_tpool_process_destroy(queue);
+    if (pool) hts_tpool_destroy(pool);
+}
+
+bool VcfReader::query(const std::string& reg) {
+    batch_size = batch_at = 0;
+    batch_status = 0;
+    if (reg.empty()) {
+        if (header_end >= 0) {
+            if (bgzf_seek(fp->fp.bgzf, header_end, SEEK_SET) < 0) {
+                error = "couldn't seek to the first record";
+                return false;
+            }
+        } else if (stream_started) {
+            error = "a vcf that isn't bgzipped can only be streamed once";
+            return false;
+        }
+        streaming = stream_started = true;
+        return true;
+    }
+    if (!csi_idx && !tbi_idx) {
+        error = "an index is needed to query region " + reg;
+        return false;
+    }
+
+    streaming = false;
+    if (itr) hts_itr_destroy(itr);
+    if (use_csi) {
+        itr = bcf_itr_querys(csi_idx, hdr, reg.c_str());
+    } else {
+        itr = tbx_itr_querys(tbi_idx, reg.c_str());
+    }
+    if (!itr) {
+        error = "itr is null for region " + reg;
+        return false;
+    }
+    return true;
+}
+
+bool VcfReader::query(const std::string& chrom, int beg, int end) {
+    batch_size = batch_at = 0;
+    batch_status = 0;
+    streaming = false;
+    int tid = contig_id(chrom);
+    if (tid < 0) {
+        error = (csi_idx || tbi_idx) ? "the index has no records for contig " + chrom
+                                     : "an index is needed to query contig " + chrom;
+        return false;
+    }
+
+    if (itr) hts_itr_destroy(itr);
+    if (use_csi) {
+        itr = bcf_itr_queryi(csi_idx, tid, beg, end);
+    } else {
+        itr = tbx_itr_queryi(tbi_idx, tid, beg, end);
+    }
+    if (!itr) {
+        error = "itr is null for contig " + chrom;
+        return false;
+    }
+    return true;
+}
+
+int VcfReader::contig_id(const std::string& chrom) const {
+    std::map<std::string, int>::const_iterator it = indexed_ids.find(chrom);
+    return it == indexed_ids.end() ? -1 : it->second;
+}
+
+int VcfReader::read_record(bcf1_t *line) {
+    if (streaming) {
+        int tid, beg, end; // bcf_readrec reports these for the index iterator
+        return bcf_readrec(fp->fp.bgzf, NULL, line, &tid, &beg, &end);
+    }
+    return bcf_itr_next(fp, itr, line);
+}
+
+int VcfReader::read_line(kstring_t *line) {
+    if (streaming) return hts_getline(fp, '\n', line);
+    return tbx_itr_next(fp, tbi_idx, itr, line);
+}
+
+void VcfReader::set_threads(int threads) {
+    if (threads <= 1 || pool) return;
+    pool = hts_tpool_init(threads);
+    if (!pool) return; // stay single-threaded
+    htsThreadPool p = {pool, 0};
+    hts_set_thread_pool(fp, &p);
+    if (!use_csi) {
+        queue = hts_tpool_process_init(pool, 2 * threads, 1);
+        if (queue) n_threads = threads;
+    }
+}
+
+// whether every name in the sep-separated list [p, end) is declared in the
+// header as the given kind of line; "." is an empty list
+static bool names_declared(bcf_hdr_t *hdr, int type, const char *p, const char *end, char sep, std::string& name) {
+    if (end - p == 1 && *p == '.') return true;
+    while (p < end) {
+        const char *next = std::find(p, end, sep);
+        const char *key_end = type == BCF_HL_INFO ? std::find(p, next, '=') : next;
+        name.assign(p, key_end - p);
+        if (!name.empty()) {
+            int id = bcf_hdr_id2int(hdr, BCF_DT_ID, name.c_str());
+            if (id < 0 || !bcf_hdr_idinfo_exists(hdr, type, id)) return false;
+        }
+        p = next + 1;
+    }
+    return true;
+}
+
+// whether vcf_parse can parse a line without changing the header. It adds any
+// contig, FILTER, INFO or FORMAT name the header doesn't declare, which would
+// give the record ids the reader's own header doesn't have.
+static bool declared_in_header(bcf_hdr_t *hdr, const kstring_t *line, std::string& name) {
+    const char *p = line->s, *end = line->s + line->l;
+    for (int col = 0; p < end && col <= 8; col++) {
+        const char *tab = std::find(p, end, '\t');
+        if (col == 0) {
+            name.assign(p, tab - p);
+            if (bcf_hdr_name2id(hdr, name.c_str()) < 0) return false;
+        } else if (col == 6) {
+            if (!names_declared(hdr, BCF_HL_FLT, p, tab, ';', name)) return false;
+        } else if (col == 7) {
+            if (!names_declared(hdr, BCF_HL_INFO, p, tab, ';', name)) return false;
+        } else if (col == 8) {
+            if (!names_declared(hdr, BCF_HL_FMT, p, tab, ':', name)) return false;
+        }
+        p = tab + 1;
+    }
+    return true;
+}
+
+struct ParseJob {
+    bcf_hdr_t *hdr;
+    const SiteFilter *filter;
+    std::vector<kstring_t> *lines;
+    std::vector<bcf1_t*> *records;
+    std::vector<char> *keep;
+    std::vector<char> *deferred;
+    size_t n;
+    size_t first;
+    size_t stride;
+    bool failed;
+};
+
+// each job parses against its own copy of the header: lines that would add to
+// it are left for fill_batch to parse on the calling thread once the batch is done
+static void *parse_batch_job(void *arg) {
+    ParseJob *job = (ParseJob *) arg;
+    std::string name;
+    for (size_t i = job->first; i < job->n; i += job->stride) {
+        if (!declared_in_header(job->hdr, &(*job->lines)[i], name)) {
+            (*job->deferred)[i] = 1;
+            continue;
+        }
+        if (vcf_parse(&(*job->lines)[i], job->hdr, (*job->records)[i]) < 0) {
+            job->failed = true;
+            return NULL;
+        }
+        (*job->keep)[i] = job->filter->pass((*job->records)[i]);
+    }
+    return NULL;
+}
+
+// (re)copy the header for the parse jobs, with the same sample subset, whenever
+// vcf_parse has added to it since; copies keep the ids (IDX) as they are
+bool VcfReader::sync_parse_headers() {
+    int size = hdr->n[BCF_DT_CTG] + hdr->n[BCF_DT_ID];
+    if ((int) parse_hdrs.size() == n_threads && size == parse_hdrs_size) return true;
+    for (size_t i = 0; i < parse_hdrs.size(); i++) bcf_hdr_destroy(parse_hdrs[i]);
+    parse_hdrs.clear();
+    for (int i = 0; i < n_threads; i++) {
+        bcf_hdr_t *copy = bcf_hdr_dup(full_hdr ? full_hdr : hdr);
+        if (!copy) {
+            error = "couldn't copy the header for parsing";
+            return false;
+        }
+        parse_hdrs.push_back(copy);
+        if (full_hdr && bcf_hdr_set_samples(copy, sample_list.c_str(), 0) != 0) {
+            error = "couldn't subset samples";
+            return false;
+        }
+    }
+    parse_hdrs_size = size;
+    return true;
+}
+
+bool VcfReader::fill_batch() {
+    // enough lines to keep every thread busy, but bounded in memory for very wide VCFs
+    const size_t max_lines = 8 * n_threads;
+    const size_t max_bytes = (size_t) 256 << 20;
+    size_t bytes = 0;
+    batch_size = batch_at = 0;
+    while (batch_size < max_lines && bytes < max_bytes) {
+        if (batch_size == batch_lines.size()) {
+            kstring_t empty = {0, 0, NULL};
+            batch_lines.push_back(empty);
+            batch_records.push_back(bcf_init());
+        }
+        batch_status = read_line(&batch_lines[batch_size]);
+        if (batch_status < 0) break;
+        bytes += batch_lines[batch_size].l;
+        batch_size++;
+    }
+    if (batch_status < -1) {
+        error = "error reading vcf record";
+        return false;
+    }
+
+    if (!sync_parse_headers()) return false;
+
+    // strided rather than contiguous slices, so one very wide line doesn't hold up a whole slice
+    batch_keep.assign(batch_size, 0);
+    batch_deferred.assign(batch_size, 0);
+    size_t n_jobs = std::min((size_t) n_threads, batch_size);
+    std::vector<ParseJob> jobs(n_jobs);
+    for (size_t j = 0; j < n_jobs; j++) {
+        ParseJob job = {parse_hdrs[j], &filter, &batch_lines, &batch_records, &batch_keep, &batch_deferred, batch_size, j, n_jobs, false};
+        jobs[j] = job;
+        hts_tpool_dispatch(pool, queue, parse_batch_job, &jobs[j]);
+    }
+    hts_tpool_process_flush(queue);
+    for (size_t j = 0; j < n_jobs; j++) {
+        if (jobs[j].failed) {
+            error = "vcf parsing error";
+            return false;
+        }
+    }
+
+    // in file order, so names are added to the header as a serial parse would add
+    // them. full_hdr gets them too, with the same ids; vcf_parse splits the line
+    // in place, so it is given a copy.
+    for (size_t i = 0; i < batch_size; i++) {
+        if (!batch_deferred[i]) continue;
+        if (full_hdr) {
+            s.l = 0;
+            kputsn(batch_lines[i].s, batch_lines[i].l, &s);
+            if (vcf_parse(&s, full_hdr, batch_records[i]) < 0) {
+                error = "vcf parsing error";
+                return false;
+            }
+        }
+        if (vcf_parse(&batch_lines[i], hdr, batch_records[i]) < 0) {
+            error = "vcf parsing error";
+            return false;
+        }
+        batch_keep[i] = filter.pass(batch_records[i]);
+    }
+    return true;
+}
+
+int VcfReader::next(bcf1_t *line) {
+    int r;
+    while (true) {
+        if (use_csi) {
+            r = read_record(line);
+            if (r < 0) break;
+            if (!filter.pass(line)) continue;
+            // bcf_readrec doesn't see the header, so a sample subset has to be applied here
+            if (hdr->keep_samples && bcf_subset_format(hdr, line) < 0) {
+                error = "couldn't subset samples";
+                return -2;
+            }
+        } else if (queue) {
+            if (batch_at == batch_size) {
+                if (batch_status < 0) return batch_status;
+                if (!fill_batch()) return -2;
+                continue;
+            }
+            size_t i = batch_at++;
+            if (!batch_keep[i]) continue;
+            // hand the parsed record over; the caller's old buffers get reused by the next batch
+            std::swap(*line, *batch_records[i]);
+            return 0;
+        } else {
+            r = read_line(&s);
+            if (r < 0) break;
+            if (vcf_parse(&s, hdr, line) < 0) {
+                error = "vcf parsing error";
+                return -2;
+            }
+            if (!filter.pass(line)) continue;
+        }
+        break;
+    }
+    if (r < -1) error = "error reading vcf record";
+    return r;
+}
+
+int64_t VcfReader::expected_records(const std::string& reg) const {
+    hts_idx_t *idx = use_csi ? csi_idx : (tbi_idx ? tbi_idx->idx : NULL);
+    if (!idx) return -1;
+    uint64_t mapped, unmapped;
+
+    // only contigs with records in the index: hts_idx_get_stat doesn't check the id
+    if (reg.empty()) {
+        int64_t total = 0;
+        for (std::map<std::string, int>::const_iterator it = indexed_ids.begin(); it != indexed_ids.end(); ++it) {
+            if (hts_idx_get_stat(idx, it->second, &mapped, &unmapped) < 0) return -1;
+            total += mapped;
+        }
+        return total;
+    }
+
+    int beg, end;
+    const char *q = hts_parse_reg(reg.c_str(), &beg, &end);
+    if (!q) return -1;
+    return expected_records(std::string(reg.c_str(), q - reg.c_str()), beg, end);
+}
+
+int64_t VcfReader::expected_records(const std::string& chrom, int beg, int end) const {
+    hts_idx_t *idx = use_csi ? csi_idx : (tbi_idx ? tbi_idx->idx : NULL);
+    if (!idx) return -1;
+    uint64_t mapped, unmapped;
+    int tid = contig_id(chrom);
+    if (tid < 0 || hts_idx_get_stat(idx, tid, &mapped, &unmapped) < 0) return -1;
+
+    // records are assumed to be spread evenly along the contig, so without a
+    // length only a query of the whole contig can be estimated
+    int rid = bcf_hdr_name2id(hdr, chrom.c_str());
+    int len = rid >= 0 ? hdr->id[BCF_DT_CTG][rid].val->info[0] : 0;
+    if (len <= 0) return beg <= 0 && end == INT_MAX ? (int64_t) mapped : -1;
+    int span = std::min(end, len) - std::min(beg, len);
+    return (int64_t) ((double) mapped * span / len + 0.5);
+}
+
+std::vector<std::string> VcfReader::indexed_contigs() const {
+    std::vector<std::string> contigs;
+    hts_idx_t *idx = use_csi ? csi_idx : (tbi_idx ? tbi_idx->idx : NULL);
+    if (!idx) return contigs;
+    int n = 0;
+    const char **names = use_csi ? bcf_index_seqnames(idx, hdr, &n) : tbx_seqnames(tbi_idx, &n);
+    for (int i = 0; i < n; i++) contigs.push_back(names[i]);
+    free(names);
+    return contigs;
+}
+
+std::vector<VcfShard> plan_contig_shards(const VcfReader& reader) {
+    std::vector<std::string> contigs = reader.indexed_contigs();
+    std::vector<VcfShard> shards;
+    for (size_t i = 0; i < contigs.size(); i++) {
+        // contigs don't share records, so every shard keeps all of its own. The
+        // name isn't turned into a region string, which would misread names
+        // with ':' or '-' in them, such as HLA-A*01:01:01:01.
+        VcfShard shard = {"", 0, INT_MAX, true, contigs[i]};
+        shards.push_back(shard);
+    }
+    return shards;
+}
+
+std::vector<VcfShard> plan_shards(const VcfReader& reader, const std::string& reg, int n_shards) {
+    std::vector<VcfShard> shards;
+    VcfShard whole = {reg, 0, INT_MAX, true};
+
+    int beg, end;
+    const char *q = hts_parse_reg(reg.c_str(), &beg, &end);
+    if (n_shards <= 1 || reg.empty() || !q) {
+        shards.push_back(whole);
+        return shards;
+    }
+    std::string chrom(reg.c_str(), q - reg.c_str());
+
+    // an open-ended query is bounded by the contig length from the header
+    int span_end = end;
+    int rid = bcf_hdr_name2id(reader.hdr, chrom.c_str());
+    if (rid >= 0) {
+        int len = reader.hdr->id[BCF_DT_CTG][rid].val->info[0];
+        if (len > 0 && len < span_end) span_end = len;
+    }
+    if (span_end == INT_MAX || span_end <= beg) {
+        shards.push_back(whole); // no ##contig length, nothing to split on
+        return shards;
+    }
+
+    // TBI and (default) CSI indexes both bin offsets into 16kb linear windows,
+    // so boundaries on window edges don't share a first chunk between shards
+    const int window = 1 << 14;
+    int step = ((span_end - beg) / n_shards + window - 1) / window * window;
+    if (step < window) step = window;
+
+    int shard_beg = beg;
+    int boundary = beg - beg % window;
+    while (true) {
+        boundary += step;
+        bool last = boundary >= span_end;
+        int shard_end = last ? end : boundary;
+        VcfShard shard = {
+            chrom + ":" + std::to_string(shard_beg + 1) + "-" + std::to_string(shard_end),
+            shard_beg, shard_end, shards.empty()
+        };
+        shards.push_back(shard);
+        if (last) break;
+        shard_beg = boundary;
+    }
+    return shards;
+}
+
+static void scan_shard(VcfReader& reader, const VcfShard& shard, bcf1_t *line, VcfKernel *kernel) {
+    if (!(shard.chrom.empty() ? reader.query(shard.reg) : reader.query(shard.chrom, shard.beg, shard.end))) {
+        kernel->error = reader.error;
+        return;
+    }
+    int r;
+    while ((r = reader.next(line)) >= 0) {
+        if (!shard.first && line->pos < shard.beg) continue; // reported by the previous shard
+        if (!kernel->add(reader.hdr, line)) return;
+    }
+    if (r < -1) kernel->error = reader.error;
+}
+
+struct TaskJob {
+    void (*fn)(void *arg, int task);
+    void *arg;
+    int task;
+    std::string error;
+};
+
+static void *run_task_job(void *arg) {
+    TaskJob *job = (TaskJob *) arg;
+    try {
+        job->fn(job->arg, job->task);
+    } catch (std::exception& e) {
+        job->error = e.what();
+    }
+    return NULL;
+}
+
+TaskPool::TaskPool(int threads) : pool(NULL), queue(NULL) {
+    if (threads <= 1) return;
+    pool = hts_tpool_init(threads);
+    if (!pool) stop("couldn't start thread pool");
+    queue = hts_tpool_process_init(pool, 2 * threads, 1);
+    if (!queue) {
+        hts_tpool_destroy(pool);
+        stop("couldn't start thread pool");
+    }
+}
+
+TaskPool::~TaskPool() {
+    if (queue) hts_tpool_process_destroy(queue);
+    if (pool) hts_tpool_destroy(pool);
+}
+
+void TaskPool::run(int n_tasks, void (*fn)(void *arg, int task), void *arg) {
+    std::vector<TaskJob> jobs(n_tasks);
+    for (int i = 0; i < n_tasks; i++) {
+        jobs[i].fn = fn;
+        jobs[i].arg = arg;
+        jobs[i].task = i;
+    }
+    if (!pool || n_tasks <= 1) {
+        for (int i = 0; i < n_tasks; i++) run_task_job(&jobs[i]);
+    } else {
+        for (int i = 0; i < n_tasks; i++) hts_tpool_dispatch(pool, queue, run_task_job, &jobs[i]);
+        hts_tpool_process_flush(queue);
+    }
+    for (int i = 0; i < n_tasks; i++) {
+        if (!jobs[i].error.empty()) stop(jobs[i].error);
+    }
+}
+
+void parallel_for(int n_tasks, int threads, void (*fn)(void *arg, int task), void *arg) {
+    TaskPool pool(std::min(threads, n_tasks));
+    pool.run(n_tasks, fn, arg);
+}
+
+struct ShardScan {
+    const VcfSource *source;
+    const std::vector<VcfShard> *shards;
+    std::vector<VcfKernel*> *kernels;
+};
+
+// each shard gets its own file handle, so shards share nothing but the job list
+static void run_shard_task(void *arg, int task) {
+    ShardScan *scan = (ShardScan *) arg;
+    VcfKernel *kernel = (*scan->kernels)[task];
+    VcfReader reader(*scan->source);
+    if (!reader.ok()) {
+        kernel->error = reader.error;
+        return;
+    }
+    bcf1_t *line = bcf_init();
+    scan_shard(reader, (*scan->shards)[task], line, kernel);
+    bcf_destroy(line);
+}
+
+void scan_shards(const VcfSource& source, VcfReader& reader,
+                 const std::vector<VcfShard>& shards, std::vector<VcfKernel*>& kernels, int threads) {
+    // the estimate is only a hint, so it is capped: a skewed contig or a wide
+    // cohort then costs at most ~1 GB of per-sample entries up front, and the
+    // buffers grow as usual past that
+    int64_t max_records = std::min((int64_t) 1 << 22, ((int64_t) 1 << 28) / std::max(1, 2 * bcf_hdr_nsamples(reader.hdr)));
+    for (size_t i = 0; source.filter.empty() && i < shards.size(); i++) {
+        const VcfShard& shard = shards[i];
+        int64_t n = shard.chrom.empty() ? reader.expected_records(shard.reg)
+                                        : reader.expected_records(shard.chrom, shard.beg, shard.end);
+        n = std::min(n, max_records);
+        if (n > 0) kernels[i]->reserve(reader.hdr, n);
+    }
+
+    if (shards.size() == 1) {
+        reader.set_threads(threads);
+        bcf1_t *line = bcf_init();
+        scan_shard(reader, shards[0], line, kernels[0]);
+        bcf_destroy(line);
+    } else {
+        ShardScan scan = {&source, &shards, &kernels};
+        parallel_for(shards.size(), std::max(1, std::min((int) shards.size(), threads)), run_shard_task, &scan);
+    }
+
+    for (size_t i = 0; i < kernels.size(); i++) {
+        if (!kernels[i]->error.empty()) stop(kernels[i]->error);
+    }
+}
+
+// parses the "chrom<TAB>start<TAB>end<TAB>query" lines QueryRegions feeds to regidx
+static int parse_query_line(const char *line, char **chr_beg, char **chr_end, reg_t *reg, void *payload, void *usr) {
+    char *tab = strchr((char *) line, '\t');
+    if (!tab) return -1;
+    *chr_beg = (char *) line;
+    *chr_end = tab - 1;
+    char *end;
+    reg->start = strtoul(tab + 1, &end, 10);
+    reg->end = strtoul(end + 1, &end, 10);
+    *(int *) payload = strtol(end + 1, NULL, 10);
+    return 0;
+}
+
+struct QueryOrder {
+    const std::vector<QueryInterval> *queries;
+    const std::vector<int> *contig_rank;
+    bool operator()(int a, int b) const {
+        int ra = (*contig_rank)[a], rb = (*contig_rank)[b];
+        if (ra != rb) return ra < rb;
+        return (*queries)[a].beg < (*queries)[b].beg;
+    }
+};
+
+QueryRegions::QueryRegions(const std::vector<QueryInterval>& queries)
+    : idx(regidx_init(NULL, parse_query_line, NULL, sizeof(int), NULL)) {
+    // rank contigs by first appearance so the output follows the caller's contig order
+    std::vector<std::string> contigs;
+    std::vector<int> contig_rank(queries.size());
+    std::vector<int> order;
+    for (size_t i = 0; i < queries.size(); i++) {
+        std::vector<std::string>::iterator it = std::find(contigs.begin(), contigs.end(), queries[i].chrom);
+        contig_rank[i] = it - contigs.begin();
+        if (it == contigs.end()) contigs.push_back(queries[i].chrom);
+        if (queries[i].beg >= queries[i].end) continue; // empty, matches nothing
+
+        order.push_back(i);
+        std::string line = queries[i].chrom + "\t" + std::to_string(queries[i].beg) + "\t" +
+                           std::to_string(queries[i].end - 1) + "\t" + std::to_string(i);
+        regidx_insert(idx, &line[0]);
+    }
+    regidx_insert(idx, NULL); // builds the index
+
+    QueryOrder by_position = {&queries, &contig_rank};
+    std::sort(order.begin(), order.end(), by_position);
+    for (size_t k = 0; k < order.size(); k++) {
+        const QueryInterval& q = queries[order[k]];
+        if (!merged.empty() && merged.back().chrom == q.chrom && q.beg <= merged.back().end) {
+            merged.back().end = std::max(merged.back().end, q.end);
+        } else {
+            merged.push_back(q);
+        }
+    }
+}
+
+QueryRegions::~QueryRegions() {
+    regidx_destroy(idx);
+}
+
+void QueryRegions::overlaps(const char *chrom, int beg, int end, std::vector<int>& out) const {
+    regitr_t itr;
+    if (!regidx_overlap(idx, chrom, beg, end - 1, &itr)) return;
+    // REGITR_OVERLAP stops at the first interval ending before beg, which can hide later overlaps
+    for (; itr.i < itr.n && (int) REGITR_START(itr) < end; itr.i++) {
+        if ((int) REGITR_END(itr) >= beg) out.push_back(REGITR_PAYLOAD(itr, int));
+    }
+}
+
+void scan_regions(VcfReader& reader, const QueryRegions& regions, VcfKernel *kernel, RegionHits *hits) {
+    BcfRecord record;
+    bcf1_t *line = record.line;
+    for (size_t m = 0; m < regions.merged.size(); m++) {
+        const QueryInterval& q = regions.merged[m];
+        if (reader.contig_id(q.chrom) < 0) continue; // the index has no records there
+        if (!reader.query(q.chrom, q.beg, q.end)) stop(reader.error);
+
+        // a record starting before the previous interval ended was reported there
+        int prev_end = m > 0 && regions.merged[m - 1].chrom == q.chrom ? regions.merged[m - 1].end : INT_MIN;
+        int r;
+        while ((r = reader.next(line)) >= 0) {
+            if (line->pos < prev_end) continue;
+            if (!kernel->add(reader.hdr, line)) stop(kernel->error);
+            if (!hits) continue;
+            hits->rids.push_back(line->rid);
+            hits->positions.push_back(line->pos);
+            regions.overlaps(q.chrom.c_str(), line->pos, line->pos + std::max(line->rlen, 1), hits->queries);
+            hits->ends.push_back(hits->queries.size());
+        }
+        if (r < -1) stop(reader.error);
+        checkUserInterrupt();
+    }
+}
@@ -0,0 +1,266 @@
+#ifndef HTSLIBR_VCF_READER_H
+#define HTSLIBR_VCF_READER_H
+
+#include<Rcpp.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "htslib/tbx.h"
+#include "htslib/thread_pool.h"
+#include "htslib/regidx.h"
+#include "vcf_filter.h"
+
+// where to read from; every worker thread opens its own handle on this
+struct VcfSource {
+    std::string vcf;
+    std::string index;                // empty for an unindexed file, which can only be streamed
+    std::vector<std::string> samples; // subset to these samples, empty keeps all
+    std::string filter;               // site filter expression (see SiteFilter), empty keeps all
+};
+
+// a piece of a region query. Records belong to the shard they start in, so a
+// record straddling a boundary is only reported once. The first shard also
+// keeps records that start before the query but overlap it.
+struct VcfShard {
+    std::string reg;
+    int beg;
+    int end;
+    bool first;
+    std::string chrom; // when set, the shard is [beg, end) of this contig, queried by name instead of reg
+};
+
+// wraps the CSI (bcf_itr_next) and TBI (tbx_itr_next + vcf_parse) paths
+// behind one next() call. An empty reg streams the whole file from the first
+// record instead, through the same binary or text path without an iterator.
+// Errors are reported through `error` rather than stop() because readers are
+// also used on worker threads.
+class VcfReader {
+public:
+    VcfReader(const VcfSource& source, bool verbose = false);
+    ~VcfReader();
+
+    bool query(const std::string& reg);
+    // query [beg, end) (0-based, end-exclusive) of a contig given by name, so
+    // names that look like regions (e.g. HLA-A*01:01:01:01) are taken as they are
+    bool query(const std::string& chrom, int beg, int end);
+    // the index's id for a contig it has records for, or -1
+    int contig_id(const std::string& chrom) const;
+    // for sequential, single-handle scans: decompress BGZF blocks on a thread
+    // pool, and on the TBI path also run vcf_parse on batches of lines there,
+    // each worker against its own copy of the header (vcf_parse uses the
+    // header's scratch space). vcf_parse adds undeclared contigs and tags to the
+    // header, so lines using any are parsed on the calling thread after the rest
+    // of their batch.
+    void set_threads(int threads);
+    // >= 0 on success, -1 at the end of the region, < -1 on error. Records
+    // failing the source's filter are skipped before FORMAT is unpacked.
+    int next(bcf1_t *line);
+    bool ok() const { return error.empty(); }
+    // whether query("") can restart the stream, so the records can be read twice
+    bool rewindable() const { return header_end >= 0; }
+    // how many records reg is likely to hold, from the index's per-contig
+    // counts (scaled by the fraction of the contig queried), or -1 if unknown,
+    // e.g. for part of a contig the header gives no length for
+    int64_t expected_records(const std::string& reg) const;
+    int64_t expected_records(const std::string& chrom, int beg, int end) const;
+    // the contigs the index has records for, in index order; empty without an index
+    std::vector<std::string> indexed_contigs() const;
+
+    htsFile *fp;
+    bcf_hdr_t *hdr;
+    bool use_csi;
+    std::string error;
+
+private:
+    VcfReader(const VcfReader&);
+    VcfReader& operator=(const VcfReader&);
+
+    hts_idx_t *csi_idx;
+    tbx_t *tbi_idx;
+    hts_itr_t *itr;
+    kstring_t s;
+    SiteFilter filter;
+    std::map<std::string, int> indexed_ids; // see contig_id()
+
+    // whole-file streaming, when query() was given an empty reg
+    int read_record(bcf1_t *line);
+    int read_line(kstring_t *line);
+    bool streaming;
+    bool stream_started;
+    int64_t header_end; // BGZF offset of the first record
+
+    // parallel TBI parsing: raw lines are read in batches and parsed into
+    // records on the pool, then handed out in file order
+    bool fill_batch();
+    bool sync_parse_headers();
+
+    hts_tpool *pool;
+    hts_tpool_process *queue;
+    int n_threads;
+    std::string sample_list; // what bcf_hdr_set_samples was given, "" for all samples
+    // hdr before its samples were subset (copies of a subset header expect
+    // subset lines), kept in step with what vcf_parse adds; NULL without a subset
+    bcf_hdr_t *full_hdr;
+    std::vector<bcf_hdr_t*> parse_hdrs; // one copy of full_hdr (or hdr) per parse job
+    int parse_hdrs_size; // hdr's contig + ID dictionary size when they were copied
+    std::vector<kstring_t> batch_lines;
+    std::vector<bcf1_t*> batch_records;
+    std::vector<char> batch_keep;
+    std::vector<char> batch_deferred; // lines left for the calling thread to parse
+    size_t batch_size;
+    size_t batch_at;
+    int batch_status; // what the iterator returned after the last line of the batch
+};
+
+// an optional string argument from R: NULL becomes ""
+inline std::string optional_string(const Rcpp::Nullable<Rcpp::CharacterVector>& x) {
+    return x.isNull() ? std::string() : Rcpp::as<std::string>(x.get());
+}
+
+// build a data.frame without as.data.frame(), which would split list columns apart
+inline Rcpp::DataFrame make_data_frame(Rcpp::List columns, Rcpp::CharacterVector names, int n) {
+    columns.attr("names") = names;
+    columns.attr("class") = "data.frame";
+    columns.attr("row.names") = Rcpp::IntegerVector::create(NA_INTEGER, -n);
+    return Rcpp::DataFrame(columns);
+}
+
+// owns a bcf1_t for pull-style loops that may stop() part way through
+struct BcfRecord {
+    BcfRecord() : line(bcf_init()) {}
+    ~BcfRecord() { bcf_destroy(line); }
+    bcf1_t *line;
+};
+
+// owns an htslib-allocated array (e.g. for bcf_get_genotypes/bcf_get_info_*)
+template <class T>
+struct HtsBuffer {
+    HtsBuffer() : p(NULL), n(0) {}
+    ~HtsBuffer() { free(p); }
+    T *p;
+    int n;
+};
+
+// copy a rows x cols row-major block into column `row0` onwards of a
+// column-major matrix with `out_rows` rows, i.e. transpose it, in 64 x 64
+// tiles so both the reads and the writes stay within a few cache lines
+template <class T>
+void transpose_tiled(const T *in, size_t rows, size_t cols, T *out, size_t out_rows, size_t row0) {
+    const size_t tile = 64;
+    for (size_t r0 = 0; r0 < rows; r0 += tile) {
+        size_t r1 = std::min(rows, r0 + tile);
+        for (size_t c0 = 0; c0 < cols; c0 += tile) {
+            size_t c1 = std::min(cols, c0 + tile);
+            for (size_t c = c0; c < c1; c++) {
+                T *dst = out + c * out_rows + row0;
+                for (size_t r = r0; r < r1; r++) dst[r] = in[r * cols + c];
+            }
+        }
+    }
+}
+
+// per-shard accumulator. add() runs on worker threads, so it must not touch
+// the R API; return false and fill in `error` to abort the scan.
+class VcfKernel {
+public:
+    virtual ~VcfKernel() {}
+    virtual bool add(bcf_hdr_t *hdr, bcf1_t *line) = 0;
+    // called before the scan with the index's estimate of the shard's record
+    // count, to size the result buffers up front rather than by doubling
+    virtual void reserve(const bcf_hdr_t *hdr, size_t n_records) {}
+    std::string error;
+};
+
+template <class K>
+std::vector<VcfKernel*> kernel_ptrs(std::vector<K>& kernels) {
+    std::vector<VcfKernel*> ptrs;
+    for (size_t i = 0; i < kernels.size(); i++) ptrs.push_back(&kernels[i]);
+    return ptrs;
+}
+
+// a query interval, 0-based and end-exclusive
+struct QueryInterval {
+    std::string chrom;
+    int beg;
+    int end;
+};
+
+// a batch of query intervals. Overlapping and adjacent intervals are merged so
+// each stretch of the file is read once, and a regidx maps every record back
+// to the intervals it overlaps.
+class QueryRegions {
+public:
+    QueryRegions(const std::vector<QueryInterval>& queries);
+    ~QueryRegions();
+
+    // append the indices of the queries overlapping [beg, end) to out
+    void overlaps(const char *chrom, int beg, int end, std::vector<int>& out) const;
+
+    // grouped by contig in order of first appearance, sorted within a contig
+    std::vector<QueryInterval> merged;
+
+private:
+    QueryRegions(const QueryRegions&);
+    QueryRegions& operator=(const QueryRegions&);
+
+    regidx_t *idx;
+};
+
+// what scan_regions saw: the position of every record the kernel took and,
+// CSR-style, the queries it overlaps (queries[ends[i-1]..ends[i]) for record i)
+struct RegionHits {
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<int> queries;
+    std::vector<size_t> ends;
+};
+
+// run kernel over the merged intervals with the one reader, reporting every
+// record once even when it spans two of them. Merged intervals on contigs the
+// index has no records for match nothing. hits may be NULL when the kernel doesn't
+// need to know which queries a record overlaps. Calls stop() on error.
+void scan_regions(VcfReader& reader, const QueryRegions& regions, VcfKernel *kernel, RegionHits *hits);
+
+// an htslib thread pool that runs rounds of tasks, started once and reused so
+// that scans dispatching a round per block don't spawn threads per block
+class TaskPool {
+public:
+    // threads <= 1 runs every task on the calling thread
+    TaskPool(int threads);
+    ~TaskPool();
+
+    // run fn(arg, task) for every task in [0, n_tasks) and wait for them all.
+    // fn runs on worker threads and must not touch the R API. Calls stop() if
+    // a task threw.
+    void run(int n_tasks, void (*fn)(void *arg, int task), void *arg);
+
+private:
+    TaskPool(const TaskPool&);
+    TaskPool& operator=(const TaskPool&);
+
+    hts_tpool *pool;
+    hts_tpool_process *queue;
+};
+
+// a single round of TaskPool::run on a pool of its own
+void parallel_for(int n_tasks, int threads, void (*fn)(void *arg, int task), void *arg);
+
+// split reg into at most n_shards pieces aligned to the index's linear windows
+std::vector<VcfShard> plan_shards(const VcfReader& reader, const std::string& reg, int n_shards);
+
+// one shard per indexed contig, for whole-genome scans read contig-parallel;
+// empty without an index
+std::vector<VcfShard> plan_contig_shards(const VcfReader& reader);
+
+// run kernels[i] over shards[i], concurrently on up to `threads` threads when
+// there is more than one shard. A lone shard (e.g. a contig without a length) is read on `reader`
+// with set_threads(threads) instead. Kernels are reserve()d first, with a
+// capped estimate, unless a filter makes the index counts meaningless. Calls stop() with the first
+// kernel error.
+void scan_shards(const VcfSource& source, VcfReader& reader,
+                 const std::vector<VcfShard>& shards, std::vector<VcfKernel*>& kernels, int threads = 1);
+
+#endif
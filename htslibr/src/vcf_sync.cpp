@@ -0,0 +1,227 @@
+#include<Rcpp.h>
+#include <cstring>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "htslib/synced_bcf_reader.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+// owns a bcf_srs_t so stop() part way through doesn't leak the readers or their thread pool
+struct SyncedReaders {
+    SyncedReaders() : sr(bcf_sr_init()) {}
+    ~SyncedReaders() { bcf_sr_destroy(sr); }
+    bcf_srs_t *sr;
+};
+
+static int pair_logic(const std::string& pair) {
+    if (pair == "exact") return BCF_SR_PAIR_EXACT;
+    if (pair == "both") return BCF_SR_PAIR_BOTH;
+    if (pair == "both_ref") return BCF_SR_PAIR_BOTH_REF;
+    if (pair == "snps") return BCF_SR_PAIR_SNPS;
+    if (pair == "indels") return BCF_SR_PAIR_INDELS;
+    if (pair == "some") return BCF_SR_PAIR_SOME;
+    if (pair == "any") return BCF_SR_PAIR_ANY;
+    stop("pair must be one of exact, both, both_ref, snps, indels, some or any");
+}
+
+// a Number=1 Integer/Float INFO field as resolved against one file's header
+struct SyncedInfo {
+    int type; // BCF_HT_INT, BCF_HT_REAL, or -1 when the file doesn't define it
+};
+
+//' join several VCF/BCF files on position and alleles in one pass
+//' @param vcf a character vector of VCF/BCF file paths, e.g. one per batch or per chromosome
+//' @param reg one or more comma-separated region queries of the form: chr:start-end. Every file needs an index
+//' (.csi or .tbi) next to it, which the synced reader finds on its own.
+//' @param pair how records are matched across files: "exact" (same REF and ALT alleles), "both" (SNPs with SNPs and
+//' indels with indels, as long as some ALT allele is shared), "both_ref" (as "both", also pairing REF-only records),
+//' "snps", "indels", "some" (any shared ALT allele) or "any" (position only)
+//' @param require_all keep only the sites present in every file (an inner join) rather than every site seen in any
+//' file (an outer join)
+//' @param genotypes whether to return the GT field of every file
+//' @param info an optional character vector of Number=1 Integer or Float INFO fields to return for every file
+//' @param threads the number of threads in the synced reader's pool, shared by all files for BGZF decompression
+//' @description Use this function to line up genotypes or INFO values across files with htslib's synced reader
+//' instead of extracting every file separately and merging in R. All files are streamed together in position
+//' order, and each output row is one matched site.
+//' @details The reported alleles of a site come from the first file that has it. Genotypes of the other files are
+//' recoded to those alleles by allele string, so with looser pair rules an allele absent from the reported ones
+//' becomes NA. Calls are NA when missing, for the second haplotype of haploid calls, and for files without the site.
+//' @return a list with the chrom, pos, ref and alt (comma-separated) of each site, present, a logical sites x files
+//' matrix, genotypes, a list with one haplotypes x sites integer matrix per file, and info, a list with one
+//' sites x files numeric matrix per INFO field
+//' @examples
+//' \dontrun{
+//' joined <- join_vcfs(c("batch1.bcf", "batch2.bcf"), "1:10001-100500", require_all = TRUE, info = "AF")
+//' plot(joined$info$AF[, 1], joined$info$AF[, 2])
+//' }
+// [[Rcpp::export]]
+List join_vcfs(std::vector<std::string> vcf, std::string reg, std::string pair = "both", bool require_all = false,
+               bool genotypes = true, Nullable<CharacterVector> info = R_NilValue, int threads = 1) {
+    size_t n_files = vcf.size();
+    if (n_files == 0) stop("vcf must name at least one file");
+    std::vector<std::string> tags;
+    if (info.isNotNull()) tags = as<std::vector<std::string> >(info.get());
+
+    SyncedReaders readers;
+    bcf_srs_t *sr = readers.sr;
+    bcf_sr_set_opt(sr, BCF_SR_REQUIRE_IDX);
+    bcf_sr_set_opt(sr, BCF_SR_PAIR_LOGIC, pair_logic(pair));
+    // the regions and the thread pool have to be in place before the readers are added
+    if (bcf_sr_set_regions(sr, reg.c_str(), 0) < 0) stop("couldn't parse region %s", reg);
+    if (threads > 1 && bcf_sr_set_threads(sr, threads) < 0) stop("couldn't start thread pool");
+    for (size_t f = 0; f < n_files; f++) {
+        if (!bcf_sr_add_reader(sr, vcf[f].c_str())) {
+            stop("couldn't open %s: %s", vcf[f], bcf_sr_strerror(sr->errnum));
+        }
+    }
+
+    std::vector<int> n_samples(n_files);
+    std::vector<std::vector<SyncedInfo> > fields(n_files, std::vector<SyncedInfo>(tags.size()));
+    for (size_t f = 0; f < n_files; f++) {
+        bcf_hdr_t *hdr = bcf_sr_get_header(sr, f);
+        n_samples[f] = bcf_hdr_nsamples(hdr);
+        for (size_t t = 0; t < tags.size(); t++) {
+            int id = bcf_hdr_id2int(hdr, BCF_DT_ID, tags[t].c_str());
+            fields[f][t].type = -1;
+            if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id)) continue;
+            int type = bcf_hdr_id2type(hdr, BCF_HL_INFO, id);
+            if ((type != BCF_HT_INT && type != BCF_HT_REAL) || bcf_hdr_id2length(hdr, BCF_HL_INFO, id) != BCF_VL_FIXED ||
+                bcf_hdr_id2number(hdr, BCF_HL_INFO, id) != 1) {
+                stop("info field %s of %s is not a Number=1 Integer/Float", tags[t], vcf[f]);
+            }
+            fields[f][t].type = type;
+        }
+    }
+
+    std::vector<int> positions;
+    std::vector<std::string> contigs, refs, alts;
+    std::vector<int> present;                        // sites x files, row-major
+    std::vector<std::vector<int> > gts(n_files);     // haplotypes x sites per file
+    std::vector<std::vector<double> > values(tags.size()); // sites x files per tag, row-major
+    std::vector<int> allele_map;
+    HtsBuffer<int32_t> gt_arr, int_arr;
+    HtsBuffer<float> float_arr;
+
+    while (bcf_sr_next_line(sr)) {
+        if (require_all) {
+            size_t n_present = 0;
+            for (size_t f = 0; f < n_files; f++) n_present += bcf_sr_has_line(sr, f) != 0;
+            if (n_present < n_files) continue;
+        }
+
+        // the first file with the site decides the reported alleles
+        size_t lead = 0;
+        while (!bcf_sr_has_line(sr, lead)) lead++;
+        bcf1_t *first = bcf_sr_get_line(sr, lead);
+        bcf_unpack(first, BCF_UN_STR);
+        // per-chromosome files needn't share their ##contig lines, so keep the name
+        contigs.push_back(bcf_seqname(bcf_sr_get_header(sr, lead), first));
+        positions.push_back(first->pos);
+        refs.push_back(first->d.allele[0]);
+        std::string alt;
+        for (int a = 1; a < first->n_allele; a++) {
+            if (a > 1) alt += ",";
+            alt += first->d.allele[a];
+        }
+        alts.push_back(alt);
+
+        for (size_t f = 0; f < n_files; f++) {
+            bcf1_t *line = bcf_sr_get_line(sr, f);
+            bcf_hdr_t *hdr = bcf_sr_get_header(sr, f);
+            present.push_back(line != NULL);
+            for (size_t t = 0; t < tags.size(); t++) {
+                double value = NA_REAL;
+                if (line && fields[f][t].type == BCF_HT_INT) {
+                    if (bcf_get_info_int32(hdr, line, tags[t].c_str(), &int_arr.p, &int_arr.n) > 0 &&
+                        int_arr.p[0] != bcf_int32_missing) {
+                        value = int_arr.p[0];
+                    }
+                } else if (line && fields[f][t].type == BCF_HT_REAL) {
+                    if (bcf_get_info_float(hdr, line, tags[t].c_str(), &float_arr.p, &float_arr.n) > 0 &&
+                        !bcf_float_is_missing(float_arr.p[0])) {
+                        value = float_arr.p[0];
+                    }
+                }
+                values[t].push_back(value);
+            }
+            if (!genotypes) continue;
+
+            std::vector<int>& out = gts[f];
+            size_t base = out.size();
+            out.resize(base + 2 * n_samples[f], NA_INTEGER);
+            if (!line) continue;
+
+            bcf_unpack(line, BCF_UN_STR);
+            allele_map.assign(line->n_allele, NA_INTEGER);
+            for (int a = 0; a < line->n_allele; a++) {
+                for (int b = 0; b < first->n_allele; b++) {
+                    if (strcmp(line->d.allele[a], first->d.allele[b]) == 0) {
+                        allele_map[a] = b;
+                        break;
+                    }
+                }
+            }
+
+            int ngt = bcf_get_genotypes(hdr, line, &gt_arr.p, &gt_arr.n);
+            int max_ploidy = ngt > 0 && n_samples[f] > 0 ? ngt / n_samples[f] : 0;
+            for (int i = 0; i < n_samples[f]; i++) {
+                for (int j = 0; j < 2 && j < max_ploidy; j++) {
+                    int32_t g = gt_arr.p[i * max_ploidy + j];
+                    if (g == bcf_int32_vector_end || bcf_gt_is_missing(g)) continue;
+                    int a = bcf_gt_allele(g);
+                    if (a < line->n_allele) out[base + 2 * i + j] = allele_map[a];
+                }
+            }
+        }
+        checkUserInterrupt();
+    }
+    if (sr->errnum) stop(bcf_sr_strerror(sr->errnum));
+
+    size_t n = positions.size();
+    CharacterVector chroms(n), ref(n), alt(n);
+    IntegerVector pos(n);
+    for (size_t i = 0; i < n; i++) {
+        chroms[i] = contigs[i];
+        pos[i] = positions[i];
+        ref[i] = refs[i];
+        alt[i] = alts[i];
+    }
+
+    LogicalMatrix present_out(n, n_files);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t f = 0; f < n_files; f++) present_out(i, f) = present[i * n_files + f];
+    }
+    present_out.attr("dimnames") = List::create(R_NilValue, wrap(vcf));
+
+    List gt_out(genotypes ? n_files : 0);
+    for (size_t f = 0; genotypes && f < n_files; f++) {
+        IntegerVector m(gts[f].begin(), gts[f].end());
+        m.attr("dim") = Dimension(2 * n_samples[f], n); // haplotypes x sites
+        gt_out[f] = m;
+        std::vector<int>().swap(gts[f]); // keep peak memory to one copy per file
+    }
+    if (genotypes) gt_out.attr("names") = wrap(vcf);
+
+    List info_out(tags.size());
+    for (size_t t = 0; t < tags.size(); t++) {
+        NumericMatrix m(n, n_files);
+        for (size_t i = 0; i < n; i++) {
+            for (size_t f = 0; f < n_files; f++) m(i, f) = values[t][i * n_files + f];
+        }
+        m.attr("dimnames") = List::create(R_NilValue, wrap(vcf));
+        info_out[t] = m;
+    }
+    if (!tags.empty()) info_out.attr("names") = wrap(tags);
+
+    return List::create(
+        Named("chrom") = chroms,
+        Named("pos") = pos,
+        Named("ref") = ref,
+        Named("alt") = alt,
+        Named("present") = present_out,
+        Named("genotypes") = gt_out,
+        Named("info") = info_out
+    );
+}
@@ -0,0 +1,211 @@
+#include<Rcpp.h>
+#include <cstring>
+#include <cstdlib>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "htslib/regidx.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+// numbers the data lines of an interval file as regidx reads them, so every
+// interval's payload is its 0-based row in the file
+struct IntervalRows {
+    bool gtf;
+    int n;
+};
+
+// BED (0-based, half-open) or GTF/GFF (1-based, inclusive) lines, skipping
+// comments and track/browser lines
+static int parse_interval_line(const char *line, char **chr_beg, char **chr_end, reg_t *reg, void *payload, void *usr) {
+    IntervalRows *rows = (IntervalRows *) usr;
+    if (*line == '#' || *line == '\0' || !strncmp(line, "track", 5) || !strncmp(line, "browser", 7)) return -1;
+
+    const char *tab = strchr(line, '\t');
+    if (!tab) return -2;
+    *chr_beg = (char *) line;
+    *chr_end = (char *) tab - 1;
+
+    // GTF has source and feature columns before start and end
+    const char *p = tab + 1;
+    if (rows->gtf) {
+        for (int skip = 0; skip < 2; skip++) {
+            p = strchr(p, '\t');
+            if (!p) return -2;
+            p++;
+        }
+    }
+    char *end;
+    long start = strtol(p, &end, 10);
+    if (end == p || *end != '\t') return -2;
+    p = end + 1;
+    long stop = strtol(p, &end, 10);
+    if (end == p) return -2;
+
+    // regidx wants 0-based, inclusive coordinates
+    reg->start = rows->gtf ? start - 1 : start;
+    reg->end = stop - 1;
+    if (reg->end < reg->start) return -2;
+    *(int *) payload = rows->n++;
+    return 0;
+}
+
+struct IntervalIndex {
+    IntervalIndex() : idx(NULL) {}
+    ~IntervalIndex() { if (idx) regidx_destroy(idx); }
+    regidx_t *idx;
+};
+
+// joins the records of a shard against the intervals with a sweep line. The
+// records come sorted by position, so each contig's intervals (sorted by
+// start) are walked once: intervals enter the active set when a record
+// reaches their start and leave it for good once a record starts past their
+// end.
+class AnnotationKernel : public VcfKernel {
+public:
+    AnnotationKernel(regidx_t *idx, bool count_only)
+        : idx(idx), count_only(count_only), rid(-1), regs(NULL), payloads(NULL), n_regs(0), next(0) {}
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        if (line->rid != rid) start_contig(bcf_hdr_id2name(hdr, line->rid), line->rid);
+        uint32_t beg = line->pos;
+        uint32_t end = line->pos + (line->rlen > 0 ? line->rlen : 1) - 1;
+
+        while (next < n_regs && regs[next].start <= end) active.push_back(next++);
+        size_t kept = 0, count = 0;
+        for (size_t a = 0; a < active.size(); a++) {
+            int r = active[a];
+            if (regs[r].end < beg) continue; // ended before this record, so before every later one too
+            active[kept++] = r;
+            // a deletion can pull in intervals past the end of the next, shorter record
+            if (regs[r].start > end) continue;
+            count++;
+            if (!count_only) ids.push_back(payloads[r]);
+        }
+        active.resize(kept);
+
+        rids.push_back(line->rid);
+        positions.push_back(line->pos);
+        counts.push_back(count);
+        if (!count_only) ends.push_back(ids.size());
+        return true;
+    }
+
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        rids.reserve(n_records);
+        positions.reserve(n_records);
+        counts.reserve(n_records);
+        if (!count_only) ends.reserve(n_records);
+    }
+
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<int> counts;
+    std::vector<int> ids;     // 0-based interval rows, CSR-style
+    std::vector<size_t> ends; // ids[ends[i-1]..ends[i]) for record i
+
+private:
+    void start_contig(const char *chrom, int new_rid) {
+        rid = new_rid;
+        next = n_regs = 0;
+        active.clear();
+        regitr_t itr;
+        // the iterator runs over the rest of the contig's sorted intervals
+        if (regidx_overlap(idx, chrom, 0, UINT32_MAX - 1, &itr)) {
+            regs = itr.reg;
+            payloads = (int *) itr.payload;
+            n_regs = itr.n;
+        }
+    }
+
+    regidx_t *idx;
+    bool count_only;
+    int rid;
+    const reg_t *regs;
+    const int *payloads;
+    int n_regs;
+    int next;
+    std::vector<int> active;
+};
+
+static bool is_gtf(const std::string& path) {
+    const char *suffixes[] = {".gtf", ".gtf.gz", ".gff", ".gff.gz", ".gff3", ".gff3.gz"};
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        size_t len = strlen(suffixes[i]);
+        if (path.size() >= len && path.compare(path.size() - len, len, suffixes[i]) == 0) return true;
+    }
+    return false;
+}
+
+//' annotate VCF records with the BED or GTF intervals they overlap
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param intervals a BED file (0-based, half-open) or, when its name ends in .gtf, .gff or .gff3 (optionally
+//' .gz), a GTF/GFF file (1-based, inclusive). It needn't be sorted.
+//' @param count_only only count the overlapping intervals of each record, leaving out the interval column
+//' @param threads the number of threads. The region is split into this many shards, aligned to the
+//' index's linear windows, which are read concurrently with one file handle each.
+//' @param filter an optional site filter expression, as in extract_info
+//' @description Use this function to join millions of sites to gene or exon intervals without building both
+//' tables in R and overlapping them there. The intervals are loaded into a regidx, sorted by contig and start,
+//' and the records, which come sorted from the file, are swept against them in one linear pass per shard.
+//' @details A record spans its reference allele (or INFO/END), so a deletion overlaps every interval it
+//' touches. Header, comment ("#"), track and browser lines of the interval file are skipped and don't count
+//' towards the row numbers.
+//' @return a dataframe with the chrom, pos and n_overlaps of each record and, unless count_only, interval: a
+//' list holding, for every record, the 1-based rows of the interval file's data lines it overlaps
+//' @examples
+//' \dontrun{
+//' ann <- annotate_sites(vcf, index, "1:10001-5000000", "gencode.exons.bed.gz", threads = 4)
+//' table(ann$n_overlaps > 0)
+//' }
+// [[Rcpp::export]]
+DataFrame annotate_sites(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                         std::string intervals, bool count_only = false, int threads = 1, std::string filter = "") {
+    IntervalRows rows = {is_gtf(intervals), 0};
+    IntervalIndex intervals_idx;
+    intervals_idx.idx = regidx_init(intervals.c_str(), parse_interval_line, NULL, sizeof(int), &rows);
+    if (!intervals_idx.idx) stop("couldn't read intervals from " + intervals);
+    Rprintf("loaded %d intervals\n", rows.n);
+
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    std::vector<AnnotationKernel> kernels(shards.size(), AnnotationKernel(intervals_idx.idx, count_only));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    size_t n = 0;
+    for (size_t k = 0; k < kernels.size(); k++) n += kernels[k].rids.size();
+
+    CharacterVector chroms(n);
+    IntegerVector positions(n), n_overlaps(n);
+    List hits(count_only ? 0 : n);
+    size_t row = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        const AnnotationKernel& kernel = kernels[k];
+        size_t start = 0;
+        for (size_t i = 0; i < kernel.rids.size(); i++, row++) {
+            chroms[row] = bcf_hdr_id2name(reader.hdr, kernel.rids[i]);
+            positions[row] = kernel.positions[i];
+            n_overlaps[row] = kernel.counts[i];
+            if (count_only) continue;
+            IntegerVector matched(kernel.ends[i] - start);
+            for (size_t j = start; j < kernel.ends[i]; j++) matched[j - start] = kernel.ids[j] + 1;
+            hits[row] = matched;
+            start = kernel.ends[i];
+        }
+    }
+
+    if (count_only) {
+        return make_data_frame(List::create(chroms, positions, n_overlaps),
+                               CharacterVector::create("chrom", "pos", "n_overlaps"), n);
+    }
+    return make_data_frame(List::create(chroms, positions, n_overlaps, hits),
+                           CharacterVector::create("chrom", "pos", "n_overlaps", "interval"), n);
+}
@@ -0,0 +1,273 @@
+#include<Rcpp.h>
+#include <cmath>
+#include <cstring>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+// how dosages are packed: 32 bits stores the float as-is, 8 and 16 bits store
+// round(x / scale * levels) with the top code reserved for missing values.
+// encode() returns false for a value outside [0, scale], which can't be quantized
+struct DosageCodec {
+    DosageCodec(int bits, double scale) : bits(bits), bytes(bits / 8), scale(scale),
+        levels(bits == 32 ? 0 : (1u << bits) - 2) {}
+
+    bool encode(float x, uint8_t *out) const {
+        if (bits == 32) {
+            if (bcf_float_is_missing(x) || bcf_float_is_vector_end(x)) x = NAN;
+            memcpy(out, &x, sizeof(float));
+            return true;
+        }
+        uint32_t code = levels + 1;
+        if (!bcf_float_is_missing(x) && !bcf_float_is_vector_end(x) && !std::isnan(x)) {
+            if (x < 0 || x > scale) return false;
+            code = (uint32_t) std::floor(x / scale * levels + 0.5);
+        }
+        out[0] = code & 0xff;
+        if (bits == 16) out[1] = code >> 8;
+        return true;
+    }
+
+    void encode_missing(uint8_t *out) const {
+        if (bits == 32) {
+            float x = NAN;
+            memcpy(out, &x, sizeof(float));
+            return;
+        }
+        out[0] = (levels + 1) & 0xff;
+        if (bits == 16) out[1] = (levels + 1) >> 8;
+    }
+
+    double decode(const uint8_t *in) const {
+        if (bits == 32) {
+            float x;
+            memcpy(&x, in, sizeof(float));
+            return std::isnan(x) ? NA_REAL : x;
+        }
+        uint32_t code = bits == 16 ? in[0] | (in[1] << 8) : in[0];
+        return code > levels ? NA_REAL : code * scale / levels;
+    }
+
+    int bits;
+    int bytes;
+    double scale;
+    uint32_t levels;
+};
+
+// packs `depth` values per sample of each record as it is decoded, so the
+// shard never holds more than the packed bytes
+class DosageKernel : public VcfKernel {
+public:
+    DosageKernel(const std::string& tag, int depth, const DosageCodec& codec)
+        : tag(tag), depth(depth), codec(codec), buf(NULL), nbuf(0) {}
+    DosageKernel(const DosageKernel& other)
+        : tag(other.tag), depth(other.depth), codec(other.codec), buf(NULL), nbuf(0) {}
+    ~DosageKernel() { free(buf); }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        if (line->n_allele > 2) {
+            error = "dosages are only supported for biallelic records";
+            return false;
+        }
+        int n_samples = bcf_hdr_nsamples(hdr);
+        int n = bcf_get_format_float(hdr, line, tag.c_str(), &buf, &nbuf);
+        if (n == -3) {
+            n = 0; // the record doesn't carry this field
+        } else if (n < 0) {
+            error = "couldn't read format field " + tag;
+            return false;
+        }
+        int width = n_samples ? n / n_samples : 0;
+
+        rids.push_back(line->rid);
+        positions.push_back(line->pos);
+        size_t base = packed.size();
+        packed.resize(base + (size_t) n_samples * depth * codec.bytes);
+        uint8_t *out = &packed[base];
+        for (int j = 0; j < n_samples; j++) {
+            for (int d = 0; d < depth; d++, out += codec.bytes) {
+                if (d < width) {
+                    if (!codec.encode(buf[j * width + d], out)) {
+                        error = tag + " value " + std::to_string(buf[j * width + d]) + " is outside [0, " +
+                                std::to_string(codec.scale) + "]; give extract_dosage the field's scale";
+                        return false;
+                    }
+                } else {
+                    codec.encode_missing(out);
+                }
+            }
+        }
+        return true;
+    }
+
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        rids.reserve(n_records);
+        positions.reserve(n_records);
+        packed.reserve(n_records * bcf_hdr_nsamples(hdr) * depth * codec.bytes);
+    }
+
+    std::string tag;
+    int depth;
+    DosageCodec codec;
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<uint8_t> packed; // variant-major: record, then sample, then value
+
+private:
+    float *buf;
+    int nbuf;
+};
+
+//' extract imputed dosages (DS) or genotype probabilities (GP) in a compact packed form
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param tag the FORMAT field to extract: "DS" (one ALT dosage per sample, 0 to 2) or "GP" (three
+//' genotype probabilities per sample, 0 to 1). Any other Float field is packed like DS, one value per sample.
+//' @param bits how many bits to store each value in: 32 keeps the single-precision values as they are in the
+//' file, while 16 and 8 quantize them, as BGEN does, to 65534 or 254 evenly spaced levels over [0, scale]
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads. The region is split into this many shards, aligned to the
+//' index's linear windows, which are read and packed concurrently with one file handle each.
+//' @param filter an optional site filter expression, as in extract_format, e.g. "N_ALT == 1"
+//' @param scale the largest value of the field, which the top quantization level stands for. Defaults to 2 for
+//' DS and 1 for GP, and must be given to quantize any other field. Values outside [0, scale] are an error.
+//' @description Use this function for imputed VCFs, where extract_format's double-precision matrices take two
+//' to eight times more memory than the values warrant. Values are packed into a raw vector on the worker
+//' threads; dosage_matrix unpacks all or some of its variants into an ordinary numeric matrix when needed.
+//' @details Only biallelic records are supported. Missing values, and the values of haploid calls beyond the
+//' first two GP entries, are NA. Packed 32 bit values use the machine's byte order, so the raw vector should
+//' not be moved between machines of different endianness.
+//' @return a list with the chrom and pos of each record, the sample names, tag, bits, scale (the value the top
+//' quantization level stands for), depth (values per sample), and packed, the raw vector
+//' @examples
+//' \dontrun{
+//' ds <- extract_dosage(vcf, index, "1:10001-500000", "DS", bits = 8, threads = 4)
+//' x <- dosage_matrix(ds, rows = 1:1000)
+//' }
+// [[Rcpp::export]]
+List extract_dosage(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                    std::string tag = "DS", int bits = 32, Nullable<CharacterVector> samples = R_NilValue,
+                    int threads = 1, std::string filter = "", Nullable<NumericVector> scale = R_NilValue) {
+    if (bits != 8 && bits != 16 && bits != 32) stop("bits must be 8, 16 or 32");
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    bcf_hdr_t *hdr = reader.hdr;
+    int id = bcf_hdr_id2int(hdr, BCF_DT_ID, tag.c_str());
+    if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_FMT, id)) stop("format field %s does not exist", tag);
+    if (bcf_hdr_id2type(hdr, BCF_HL_FMT, id) != BCF_HT_REAL) stop("format field %s is not a Float", tag);
+    int depth = tag == "GP" ? 3 : 1;
+    double top = tag == "GP" ? 1 : 2;
+    if (scale.isNotNull()) {
+        top = as<double>(scale.get());
+        if (!(top > 0)) stop("scale must be positive");
+    } else if (bits != 32 && tag != "DS" && tag != "GP") {
+        stop("scale is needed to quantize format field %s", tag);
+    }
+    DosageCodec codec(bits, top);
+
+    int n_samples = bcf_hdr_nsamples(hdr);
+    Rprintf("detecting %d samples\n", n_samples);
+
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    std::vector<DosageKernel> kernels(shards.size(), DosageKernel(tag, depth, codec));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    size_t n = 0, n_bytes = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        n += kernels[k].rids.size();
+        n_bytes += kernels[k].packed.size();
+    }
+
+    CharacterVector chroms(n);
+    IntegerVector positions(n);
+    RawVector packed(n_bytes);
+    size_t v = 0, at = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        DosageKernel& kernel = kernels[k];
+        for (size_t i = 0; i < kernel.rids.size(); i++, v++) {
+            chroms[v] = bcf_hdr_id2name(hdr, kernel.rids[i]);
+            positions[v] = kernel.positions[i];
+        }
+        if (!kernel.packed.empty()) memcpy(RAW(packed) + at, &kernel.packed[0], kernel.packed.size());
+        at += kernel.packed.size();
+        std::vector<uint8_t>().swap(kernel.packed); // keep peak memory to one packed copy
+    }
+
+    CharacterVector sample_names(n_samples);
+    for (int j = 0; j < n_samples; j++) sample_names[j] = hdr->samples[j];
+
+    return List::create(
+        Named("chrom") = chroms,
+        Named("pos") = positions,
+        Named("samples") = sample_names,
+        Named("tag") = tag,
+        Named("bits") = bits,
+        Named("scale") = top,
+        Named("depth") = depth,
+        Named("packed") = packed
+    );
+}
+
+//' unpack the values returned by extract_dosage
+//' @param dosage the list returned by extract_dosage
+//' @param rows an optional integer vector of (1-based) variants to unpack; all of them by default
+//' @description Use this function to turn some or all of a packed dosage extract into a numeric matrix, e.g. a
+//' block of variants at a time, so that only that block is ever held as doubles.
+//' @return a variants x samples numeric matrix for DS, or a variants x samples x 3 array for GP, with the sample
+//' names as column names
+//' @examples
+//' \dontrun{
+//' ds <- extract_dosage(vcf, index, "1:10001-500000", "DS", bits = 16)
+//' af <- rowMeans(dosage_matrix(ds), na.rm = TRUE) / 2
+//' }
+// [[Rcpp::export]]
+NumericVector dosage_matrix(List dosage, Nullable<IntegerVector> rows = R_NilValue) {
+    RawVector packed = dosage["packed"];
+    CharacterVector sample_names = dosage["samples"];
+    int bits = as<int>(dosage["bits"]);
+    int depth = as<int>(dosage["depth"]);
+    DosageCodec codec(bits, as<double>(dosage["scale"]));
+    size_t n_samples = sample_names.size();
+    size_t stride = n_samples * depth * codec.bytes;
+    size_t n = stride ? packed.size() / stride : 0;
+
+    std::vector<size_t> keep;
+    if (rows.isNotNull()) {
+        IntegerVector r(rows.get());
+        for (int i = 0; i < r.size(); i++) {
+            if (r[i] == NA_INTEGER || r[i] < 1 || (size_t) r[i] > n) stop("rows must be between 1 and %d", n);
+            keep.push_back(r[i] - 1);
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) keep.push_back(i);
+    }
+
+    // element (v, j, d) of the variants x samples (x values) result is at v + m * (j + n_samples * d)
+    size_t m = keep.size();
+    NumericVector out(m * n_samples * depth);
+    for (size_t v = 0; v < m; v++) {
+        const uint8_t *in = RAW(packed) + keep[v] * stride;
+        for (size_t j = 0; j < n_samples; j++) {
+            for (int d = 0; d < depth; d++, in += codec.bytes) {
+                out[v + m * (j + n_samples * d)] = codec.decode(in);
+            }
+        }
+    }
+    if (depth == 1) {
+        out.attr("dim") = Dimension(m, n_samples);
+        out.attr("dimnames") = List::create(R_NilValue, sample_names);
+    } else {
+        out.attr("dim") = Dimension(m, n_samples, depth);
+        out.attr("dimnames") = List::create(R_NilValue, sample_names, R_NilValue);
+    }
+    return out;
+}
@@ -0,0 +1,179 @@
+#include<Rcpp.h>
+#include <cmath>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+// splits each variant by its non-reference allele frequency: rare variants
+// append their carriers to CSC columns, common ones a dense haplotype column.
+// Either way gt_arr is read once.
+class SparseGenotypeKernel : public VcfKernel {
+public:
+    SparseGenotypeKernel(double dense_af) : dense_af(dense_af), gt_arr(NULL), ngt_arr(0) { p.push_back(0); }
+    SparseGenotypeKernel(const SparseGenotypeKernel& other)
+        : dense_af(other.dense_af), gt_arr(NULL), ngt_arr(0) { p.push_back(0); }
+    ~SparseGenotypeKernel() { free(gt_arr); }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        int n_samples = bcf_hdr_nsamples(hdr);
+        int ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
+        int max_ploidy = ngt > 0 && n_samples > 0 ? ngt / n_samples : 0;
+        if (max_ploidy > 2) {
+            error = "currently only support for haploid and diploid calls";
+            return false;
+        }
+
+        // haplotype h of sample s is allele 2s + j; a haploid call leaves its second haplotype NA
+        size_t start = i.size();
+        int an = 0, ac = 0;
+        for (int s = 0; s < n_samples; s++) {
+            for (int j = 0; j < 2; j++) {
+                int32_t g = j < max_ploidy ? gt_arr[s * max_ploidy + j] : bcf_int32_vector_end;
+                if (g == bcf_int32_vector_end || bcf_gt_is_missing(g)) {
+                    i.push_back(2 * s + j);
+                    x.push_back(NA_REAL);
+                    continue;
+                }
+                an++;
+                int allele = bcf_gt_allele(g);
+                if (allele == 0) continue;
+                ac++;
+                i.push_back(2 * s + j);
+                x.push_back(allele);
+            }
+        }
+
+        rids.push_back(line->rid);
+        positions.push_back(line->pos);
+        bool dense = an > 0 && (double) ac / an > dense_af;
+        is_dense.push_back(dense);
+        if (!dense) {
+            p.push_back(i.size());
+            return true;
+        }
+
+        // too many carriers for CSC to pay off: scatter them into a dense column instead
+        size_t base = dense_values.size();
+        dense_values.resize(base + 2 * n_samples, 0);
+        for (size_t k = start; k < i.size(); k++) {
+            dense_values[base + i[k]] = std::isnan(x[k]) ? NA_INTEGER : (int) x[k];
+        }
+        i.resize(start);
+        x.resize(start);
+        return true;
+    }
+
+    // the CSC entries depend on allele counts, so only the per-variant vectors are sized
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        rids.reserve(n_records);
+        positions.reserve(n_records);
+        is_dense.reserve(n_records);
+        p.reserve(n_records + 1);
+    }
+
+    double dense_af;
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<char> is_dense;
+    std::vector<int> i;      // CSC row (haplotype) indices, 0-based
+    std::vector<double> x;   // allele index, NA when missing
+    std::vector<size_t> p;   // CSC column ends, starting with 0
+    std::vector<int> dense_values;
+
+private:
+    int32_t *gt_arr;
+    int ngt_arr;
+};
+
+//' extract genotypes as a sparse matrix of non-reference calls
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param dense_af variants whose non-reference allele frequency (among called haplotypes) is above this are
+//' returned in a dense matrix instead. Use 1 to make every variant sparse.
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads. The region is split into this many shards, aligned to the
+//' index's linear windows, which are read concurrently with one file handle each.
+//' @param filter an optional site filter expression, as in extract_genotypes
+//' @description Use this function for rare-variant regions, where the dense haplotypes x variants matrix of
+//' extract_genotypes is almost all zeros. Only non-reference and missing calls are stored, in the compressed
+//' sparse column (CSC) layout of the Matrix package's dgCMatrix, built directly while the genotypes are
+//' scanned. The few common variants, where CSC would be larger than the dense column, are split off into a
+//' dense matrix.
+//' @details Rows are haplotypes, two per sample as in extract_genotypes, and values are allele indices. Missing
+//' calls, and the second haplotype of haploid calls, are stored as explicit NA entries.
+//' @return a list with the chrom and pos of every variant, is_dense, a logical vector telling which variants
+//' went to the dense matrix, sparse, a list with the 0-based i, p and x slots and the Dim of a haplotypes x
+//' (sparse variants) dgCMatrix, and dense, an integer haplotypes x (dense variants) matrix
+//' @examples
+//' \dontrun{
+//' g <- extract_genotypes_sparse(vcf, index, "1:10001-500000", dense_af = 0.05)
+//' rare <- Matrix::sparseMatrix(i = g$sparse$i, p = g$sparse$p, x = g$sparse$x, dims = g$sparse$Dim,
+//'                              index1 = FALSE)
+//' }
+// [[Rcpp::export]]
+List extract_genotypes_sparse(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                              double dense_af = 0.05, Nullable<CharacterVector> samples = R_NilValue,
+                              int threads = 1, std::string filter = "") {
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    int n_samples = bcf_hdr_nsamples(reader.hdr);
+    Rprintf("detecting %d samples\n", n_samples);
+
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    std::vector<SparseGenotypeKernel> kernels(shards.size(), SparseGenotypeKernel(dense_af));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    size_t n = 0, nnz = 0, n_sparse = 0, n_dense_values = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        n += kernels[k].rids.size();
+        nnz += kernels[k].i.size();
+        n_sparse += kernels[k].p.size() - 1;
+        n_dense_values += kernels[k].dense_values.size();
+    }
+
+    CharacterVector chroms(n);
+    IntegerVector positions(n);
+    LogicalVector is_dense(n);
+    IntegerVector i(nnz), p(n_sparse + 1);
+    NumericVector x(nnz);
+    IntegerVector dense(n_dense_values);
+    size_t row = 0, at = 0, col = 0, dense_at = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        SparseGenotypeKernel& kernel = kernels[k];
+        for (size_t v = 0; v < kernel.rids.size(); v++, row++) {
+            chroms[row] = bcf_hdr_id2name(reader.hdr, kernel.rids[v]);
+            positions[row] = kernel.positions[v];
+            is_dense[row] = kernel.is_dense[v];
+        }
+        // shift this shard's column ends past the entries of the shards before it
+        for (size_t c = 1; c < kernel.p.size(); c++) p[++col] = at + kernel.p[c];
+        std::copy(kernel.i.begin(), kernel.i.end(), i.begin() + at);
+        std::copy(kernel.x.begin(), kernel.x.end(), x.begin() + at);
+        at += kernel.i.size();
+        std::copy(kernel.dense_values.begin(), kernel.dense_values.end(), dense.begin() + dense_at);
+        dense_at += kernel.dense_values.size();
+    }
+    dense.attr("dim") = Dimension(2 * n_samples, n_dense_values / std::max(1, 2 * n_samples));
+
+    return List::create(
+        Named("chrom") = chroms,
+        Named("pos") = positions,
+        Named("is_dense") = is_dense,
+        Named("sparse") = List::create(
+            Named("i") = i,
+            Named("p") = p,
+            Named("x") = x,
+            Named("Dim") = IntegerVector::create(2 * n_samples, n_sparse)
+        ),
+        Named("dense") = dense
+    );
+}
@@ -0,0 +1,522 @@
+#include<Rcpp.h>
+#include <cctype>
+#include <cstring>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+// exact test for Hardy-Weinberg equilibrium, following Wigginton, Cutler and
+// Abecasis (2005). het_probs is scratch space reused across variants.
+static double hwe_exact(int obs_hets, int obs_hom1, int obs_hom2, std::vector<double>& het_probs) {
+    int obs_homc = obs_hom1 < obs_hom2 ? obs_hom2 : obs_hom1;
+    int obs_homr = obs_hom1 < obs_hom2 ? obs_hom1 : obs_hom2;
+    int rare_copies = 2 * obs_homr + obs_hets;
+    int genotypes = obs_hets + obs_homc + obs_homr;
+    if (genotypes == 0) return NA_REAL;
+
+    het_probs.assign(rare_copies + 1, 0.0);
+
+    // start at the most likely number of hets and walk outwards in both directions
+    int mid = (int) ((double) rare_copies * (2 * genotypes - rare_copies) / (2 * genotypes));
+    if ((rare_copies & 1) ^ (mid & 1)) mid++;
+
+    int curr_homr = (rare_copies - mid) / 2;
+    int curr_homc = genotypes - mid - curr_homr;
+    het_probs[mid] = 1.0;
+    double sum = 1.0;
+    for (int curr_hets = mid; curr_hets > 1; curr_hets -= 2) {
+        het_probs[curr_hets - 2] = het_probs[curr_hets] * curr_hets * (curr_hets - 1.0) /
+                                   (4.0 * (curr_homr + 1.0) * (curr_homc + 1.0));
+        sum += het_probs[curr_hets - 2];
+        curr_homr++;
+        curr_homc++;
+    }
+
+    curr_homr = (rare_copies - mid) / 2;
+    curr_homc = genotypes - mid - curr_homr;
+    for (int curr_hets = mid; curr_hets <= rare_copies - 2; curr_hets += 2) {
+        het_probs[curr_hets + 2] = het_probs[curr_hets] * 4.0 * curr_homr * curr_homc /
+                                   ((curr_hets + 2.0) * (curr_hets + 1.0));
+        sum += het_probs[curr_hets + 2];
+        curr_homr--;
+        curr_homc--;
+    }
+
+    double p_obs = het_probs[obs_hets];
+    double p_hwe = 0.0;
+    for (int i = 0; i <= rare_copies; i++) {
+        if (het_probs[i] <= p_obs) p_hwe += het_probs[i];
+    }
+    p_hwe /= sum;
+    return p_hwe > 1.0 ? 1.0 : p_hwe;
+}
+
+// per-variant genotype counts, treating every non-reference allele as "alt"
+struct GenotypeCounts {
+    int n_called;
+    int an;
+    int ac;
+    int n_hom_ref;
+    int n_het;
+    int n_hom_alt;
+};
+
+static GenotypeCounts count_genotypes(const int32_t *gt_arr, int n_samples, int max_ploidy) {
+    GenotypeCounts counts = {0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < n_samples; i++) {
+        const int32_t *ptr = gt_arr + i * max_ploidy;
+        int32_t a = ptr[0];
+        int32_t b = max_ploidy > 1 ? ptr[1] : bcf_int32_vector_end;
+        if (a == bcf_int32_vector_end || bcf_gt_is_missing(a)) continue;
+        if (b == bcf_int32_vector_end) {
+            // haploid call: counts towards the allele frequency but not towards HWE
+            counts.n_called++;
+            counts.an++;
+            counts.ac += bcf_gt_allele(a) != 0;
+            continue;
+        }
+        if (bcf_gt_is_missing(b)) continue;
+        int x = bcf_gt_allele(a) != 0;
+        int y = bcf_gt_allele(b) != 0;
+        counts.n_called++;
+        counts.an += 2;
+        counts.ac += x + y;
+        counts.n_het += x ^ y;
+        counts.n_hom_alt += x & y;
+        counts.n_hom_ref += !(x | y);
+    }
+    return counts;
+}
+
+class VariantStatsKernel : public VcfKernel {
+public:
+    VariantStatsKernel() : gt_arr(NULL), ngt_arr(0) {}
+    VariantStatsKernel(const VariantStatsKernel& other) : gt_arr(NULL), ngt_arr(0) {}
+    ~VariantStatsKernel() { free(gt_arr); }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        int n_samples = bcf_hdr_nsamples(hdr);
+        int ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
+        GenotypeCounts counts = {0, 0, 0, 0, 0, 0};
+        if (ngt > 0 && n_samples > 0) counts = count_genotypes(gt_arr, n_samples, ngt / n_samples);
+
+        rids.push_back(line->rid);
+        positions.push_back(line->pos);
+        an.push_back(counts.an);
+        ac.push_back(counts.ac);
+        call_rate.push_back(n_samples ? (double) counts.n_called / n_samples : NA_REAL);
+        int n_diploid = counts.n_hom_ref + counts.n_het + counts.n_hom_alt;
+        het_rate.push_back(n_diploid ? (double) counts.n_het / n_diploid : NA_REAL);
+        hwe_p.push_back(hwe_exact(counts.n_het, counts.n_hom_ref, counts.n_hom_alt, het_probs));
+        return true;
+    }
+
+    void reserve(const bcf_hdr_t *hdr, size_t n_records) {
+        rids.reserve(n_records);
+        positions.reserve(n_records);
+        an.reserve(n_records);
+        ac.reserve(n_records);
+        call_rate.reserve(n_records);
+        het_rate.reserve(n_records);
+        hwe_p.reserve(n_records);
+    }
+
+    std::vector<int> rids;
+    std::vector<int> positions;
+    std::vector<int> an;
+    std::vector<int> ac;
+    std::vector<double> call_rate;
+    std::vector<double> het_rate;
+    std::vector<double> hwe_p;
+
+private:
+    int32_t *gt_arr;
+    int ngt_arr;
+    std::vector<double> het_probs;
+};
+
+//' compute per-variant summary statistics from the GT field
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads. The region is split into this many shards, aligned to the
+//' index's linear windows, which are read concurrently with one file handle each.
+//' @param filter an optional site filter expression over QUAL, POS, N_ALT, FILTER and INFO fields, e.g.
+//' 'FILTER == "PASS" && QUAL > 30 && AF >= 0.01 && AF <= 0.99'. Sites failing it are dropped before their
+//' FORMAT fields are decoded.
+//' @description Use this function to get allele frequency, call rate, heterozygosity and a Hardy-Weinberg
+//' p-value for each site without pulling the genotype matrix into R. Statistics are computed while the
+//' genotypes are scanned, so memory use grows with the number of samples, not samples x variants.
+//' @details All non-reference alleles are pooled into one alternate allele. A sample is called when all of
+//' its alleles are non-missing. het_rate and hwe_p only use diploid calls; hwe_p is the exact test of
+//' Wigginton et al. (2005).
+//' @return a dataframe with the chrom, pos, an (called alleles), ac (alternate allele count), af,
+//' call_rate, het_rate and hwe_p of each variant
+//' @examples
+//' \dontrun{
+//' variant_stats(vcf, index, "1:10001-100500")
+//' # a whole-genome pass, read sequentially
+//' variant_stats(vcf, NULL, NULL, threads = 8)
+//' }
+// [[Rcpp::export]]
+DataFrame variant_stats(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                        Nullable<CharacterVector> samples = R_NilValue, int threads = 1, std::string filter = "") {
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    std::vector<VariantStatsKernel> kernels(shards.size());
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    size_t n = 0;
+    for (size_t k = 0; k < kernels.size(); k++) n += kernels[k].rids.size();
+
+    CharacterVector chroms(n);
+    IntegerVector positions(n), an(n), ac(n);
+    NumericVector af(n), call_rate(n), het_rate(n), hwe_p(n);
+    size_t row = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        const VariantStatsKernel& kernel = kernels[k];
+        for (size_t i = 0; i < kernel.rids.size(); i++, row++) {
+            chroms[row] = bcf_hdr_id2name(reader.hdr, kernel.rids[i]);
+            positions[row] = kernel.positions[i];
+            an[row] = kernel.an[i];
+            ac[row] = kernel.ac[i];
+            af[row] = kernel.an[i] ? (double) kernel.ac[i] / kernel.an[i] : NA_REAL;
+            call_rate[row] = kernel.call_rate[i];
+            het_rate[row] = kernel.het_rate[i];
+            hwe_p[row] = kernel.hwe_p[i];
+        }
+    }
+
+    return DataFrame::create(
+        Named("chrom") = chroms,
+        Named("pos") = positions,
+        Named("an") = an,
+        Named("ac") = ac,
+        Named("af") = af,
+        Named("call_rate") = call_rate,
+        Named("het_rate") = het_rate,
+        Named("hwe_p") = hwe_p
+    );
+}
+
+static int base_code(char c) {
+    switch (toupper(c)) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+// 1 for a transition, 2 for a transversion, 0 if either base isn't ACGT or they're equal
+static int snv_class(char ref, char alt) {
+    int r = base_code(ref), a = base_code(alt);
+    if (r < 0 || a < 0 || r == a) return 0;
+    // A=0, C=1, G=2, T=3: A<->G and C<->T are the transitions
+    return (r ^ a) == 2 ? 1 : 2;
+}
+
+// per-sample counts over a shard, reduced across shards at the end
+class SampleQcKernel : public VcfKernel {
+public:
+    SampleQcKernel(int n_samples)
+        : n_called(n_samples), n_diploid(n_samples), n_het(n_samples), n_hom_alt(n_samples), n_ti(n_samples),
+          n_tv(n_samples), n_singleton(n_samples), n_variants(0), gt_arr(NULL), ngt_arr(0) {}
+    SampleQcKernel(const SampleQcKernel& other)
+        : n_called(other.n_called.size()), n_diploid(other.n_called.size()), n_het(other.n_called.size()),
+          n_hom_alt(other.n_called.size()), n_ti(other.n_called.size()), n_tv(other.n_called.size()),
+          n_singleton(other.n_called.size()), n_variants(0), gt_arr(NULL), ngt_arr(0) {}
+    ~SampleQcKernel() { free(gt_arr); }
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        int n_samples = bcf_hdr_nsamples(hdr);
+        n_variants++;
+        int ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);
+        if (ngt <= 0 || n_samples == 0) return true;
+        int max_ploidy = ngt / n_samples;
+        if (max_ploidy > 2) {
+            error = "currently only support for haploid and diploid calls";
+            return false;
+        }
+
+        // 1 for a biallelic transition, 2 for a transversion, 0 for anything else
+        bcf_unpack(line, BCF_UN_STR);
+        int snv = 0;
+        if (line->n_allele == 2 && strlen(line->d.allele[0]) == 1 && strlen(line->d.allele[1]) == 1) {
+            snv = snv_class(line->d.allele[0][0], line->d.allele[1][0]);
+        }
+        int singleton = count_genotypes(gt_arr, n_samples, max_ploidy).ac == 1;
+
+        // one branch-free pass over the row: x and y are the non-reference flags of a
+        // fully called sample's two alleles (y is 0 for a haploid call), and called is 0
+        // for partly or wholly missing calls. A haploid ALT call, e.g. a male's on chrX,
+        // is counted as hom-alt and never as het.
+        for (int i = 0; i < n_samples; i++) {
+            const int32_t *ptr = gt_arr + i * max_ploidy;
+            int32_t a = ptr[0];
+            int32_t b = max_ploidy > 1 ? ptr[1] : bcf_int32_vector_end;
+            int a_called = a != bcf_int32_vector_end && !bcf_gt_is_missing(a);
+            int b_haploid = b == bcf_int32_vector_end;
+            int b_called = b_haploid || !bcf_gt_is_missing(b);
+            int called = a_called & b_called;
+            int x = called & (bcf_gt_allele(a) != 0);
+            int diploid = called & !b_haploid;
+            int y = diploid & (bcf_gt_allele(b) != 0);
+            n_called[i] += called;
+            n_diploid[i] += diploid;
+            n_het[i] += diploid & (x ^ y);
+            n_hom_alt[i] += x & (y | b_haploid);
+            n_ti[i] += (snv == 1) * (x + y);
+            n_tv[i] += (snv == 2) * (x + y);
+            n_singleton[i] += singleton & (x | y);
+        }
+        return true;
+    }
+
+    std::vector<int> n_called;
+    std::vector<int> n_diploid;
+    std::vector<int> n_het;
+    std::vector<int> n_hom_alt;
+    std::vector<int> n_ti;
+    std::vector<int> n_tv;
+    std::vector<int> n_singleton;
+    int n_variants;
+
+private:
+    int32_t *gt_arr;
+    int ngt_arr;
+};
+
+//' compute per-sample QC metrics from the GT field in one pass
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads. The region is split into this many shards, aligned to the
+//' index's linear windows, which are read concurrently with one file handle each.
+//' @param filter an optional site filter expression, as in variant_stats
+//' @description Use this function for sample QC (missingness, heterozygosity, Ti/Tv, singletons) over millions
+//' of variants without extracting the genotype matrix. Every shard keeps its own per-sample counters, which are
+//' summed once the scan is done, so memory use grows with the number of samples, not samples x variants.
+//' @details All non-reference alleles are pooled into one alternate allele. A sample is called at a variant when
+//' all of its alleles are non-missing. A haploid ALT call counts towards n_hom_alt, and het_rate only uses
+//' diploid calls, so hemizygous calls (e.g. chrX in males) don't lower it. ti and tv count the alternate
+//' alleles a sample carries at biallelic SNVs, and a singleton is a variant where the sample carries the only
+//' alternate allele.
+//' @return a dataframe with one row per sample: sample, n_called, missing_rate, n_het, n_hom_alt, het_rate
+//' (n_het / the number of called diploid genotypes), ti, tv, ti_tv and n_singleton
+//' @examples
+//' \dontrun{
+//' qc <- sample_qc(vcf, NULL, NULL, threads = 8, filter = 'FILTER == "PASS"')
+//' qc[qc$missing_rate > 0.05, ]
+//' }
+// [[Rcpp::export]]
+DataFrame sample_qc(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                    Nullable<CharacterVector> samples = R_NilValue, int threads = 1, std::string filter = "") {
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    int n_samples = bcf_hdr_nsamples(reader.hdr);
+    std::vector<VcfShard> shards = plan_shards(reader, region, threads);
+    std::vector<SampleQcKernel> kernels(shards.size(), SampleQcKernel(n_samples));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    CharacterVector sample_names(n_samples);
+    IntegerVector n_called(n_samples), n_het(n_samples), n_hom_alt(n_samples);
+    IntegerVector ti(n_samples), tv(n_samples), n_singleton(n_samples);
+    NumericVector missing_rate(n_samples), het_rate(n_samples), ti_tv(n_samples);
+    std::vector<int> n_diploid(n_samples);
+    int n_variants = 0;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        const SampleQcKernel& kernel = kernels[k];
+        n_variants += kernel.n_variants;
+        for (int i = 0; i < n_samples; i++) {
+            n_called[i] += kernel.n_called[i];
+            n_diploid[i] += kernel.n_diploid[i];
+            n_het[i] += kernel.n_het[i];
+            n_hom_alt[i] += kernel.n_hom_alt[i];
+            ti[i] += kernel.n_ti[i];
+            tv[i] += kernel.n_tv[i];
+            n_singleton[i] += kernel.n_singleton[i];
+        }
+    }
+    for (int i = 0; i < n_samples; i++) {
+        sample_names[i] = reader.hdr->samples[i];
+        missing_rate[i] = n_variants ? 1.0 - (double) n_called[i] / n_variants : NA_REAL;
+        het_rate[i] = n_diploid[i] ? (double) n_het[i] / n_diploid[i] : NA_REAL;
+        ti_tv[i] = tv[i] ? (double) ti[i] / tv[i] : NA_REAL;
+    }
+
+    return DataFrame::create(
+        Named("sample") = sample_names,
+        Named("n_called") = n_called,
+        Named("missing_rate") = missing_rate,
+        Named("n_het") = n_het,
+        Named("n_hom_alt") = n_hom_alt,
+        Named("het_rate") = het_rate,
+        Named("ti") = ti,
+        Named("tv") = tv,
+        Named("ti_tv") = ti_tv,
+        Named("n_singleton") = n_singleton
+    );
+}
+
+// counters of one window
+struct WindowCounts {
+    int rid;
+    int window;
+    int n_variants;
+    int n_snv;
+    int n_indel;
+    int n_other;
+    int n_ti;
+    int n_tv;
+};
+
+// fixed-window counters. Records come sorted, so only the last window can
+// still change and the windows of a shard are appended in order.
+class WindowKernel : public VcfKernel {
+public:
+    WindowKernel(int window) : window(window) {}
+
+    bool add(bcf_hdr_t *hdr, bcf1_t *line) {
+        bcf_unpack(line, BCF_UN_STR); // REF/ALT only; INFO and FORMAT stay packed
+        int w = line->pos / window;
+        if (rows.empty() || rows.back().rid != line->rid || rows.back().window != w) {
+            WindowCounts counts = {line->rid, w, 0, 0, 0, 0, 0, 0};
+            rows.push_back(counts);
+        }
+        WindowCounts& counts = rows.back();
+        counts.n_variants++;
+
+        int types = bcf_get_variant_types(line);
+        if (types == VCF_SNP) {
+            counts.n_snv++;
+        } else if (types & VCF_INDEL) {
+            counts.n_indel++;
+        } else {
+            counts.n_other++;
+        }
+        const char *ref = line->d.allele[0];
+        if (ref[0] && !ref[1]) {
+            for (int a = 1; a < line->n_allele; a++) {
+                const char *alt = line->d.allele[a];
+                if (!alt[0] || alt[1]) continue;
+                int c = snv_class(ref[0], alt[0]);
+                counts.n_ti += c == 1;
+                counts.n_tv += c == 2;
+            }
+        }
+        return true;
+    }
+
+    int window;
+    std::vector<WindowCounts> rows;
+};
+
+//' count variants, SNVs, indels and transitions/transversions in fixed windows
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL for the whole file
+//' @param window the window size in bases. Windows start at multiples of it, counting from the start of the
+//' contig.
+//' @param threads the number of threads. A region is split into this many shards, aligned to the index's
+//' linear windows. With reg NULL and an index, each contig is a shard instead, and up to this many contigs
+//' are read concurrently with one file handle each.
+//' @param filter an optional site filter expression, as in variant_stats
+//' @description Use this function for genome-wide density and Ti/Tv plots without extracting every site.
+//' Only the REF and ALT alleles of each record are unpacked, and each record just increments the counters of
+//' its window.
+//' @details A record is a SNV when all its ALT alleles are single-base substitutions, and an indel when any
+//' is an insertion or deletion; everything else (MNPs, symbolic alleles) is other. ti and tv count ALT
+//' alleles at single-base REF positions, so a multi-allelic SNV can add to both.
+//' @return a dataframe with one row per window holding at least one record: chrom, start (0-based), end,
+//' n_variants, n_snv, n_indel, n_other, ti, tv and ti_tv
+//' @examples
+//' \dontrun{
+//' w <- window_stats(vcf, index, NULL, window = 100000, threads = 8)
+//' plot(w$start[w$chrom == "1"], w$n_variants[w$chrom == "1"], type = "l")
+//' }
+// [[Rcpp::export]]
+DataFrame window_stats(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg,
+                       int window = 100000, int threads = 1, std::string filter = "") {
+    if (window <= 0) stop("window must be positive");
+    std::string region = optional_string(reg);
+    VcfSource source = {vcf, optional_string(index)};
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+
+    std::vector<VcfShard> shards;
+    if (region.empty() && threads > 1) shards = plan_contig_shards(reader);
+    if (shards.empty()) shards = plan_shards(reader, region, threads);
+    std::vector<WindowKernel> kernels(shards.size(), WindowKernel(window));
+    std::vector<VcfKernel*> ptrs = kernel_ptrs(kernels);
+    scan_shards(source, reader, shards, ptrs, threads);
+
+    // a window cut by a shard boundary shows up at the end of one shard and the start of the next
+    std::vector<WindowCounts> rows;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        for (size_t i = 0; i < kernels[k].rows.size(); i++) {
+            const WindowCounts& r = kernels[k].rows[i];
+            if (!rows.empty() && rows.back().rid == r.rid && rows.back().window == r.window) {
+                WindowCounts& last = rows.back();
+                last.n_variants += r.n_variants;
+                last.n_snv += r.n_snv;
+                last.n_indel += r.n_indel;
+                last.n_other += r.n_other;
+                last.n_ti += r.n_ti;
+                last.n_tv += r.n_tv;
+            } else {
+                rows.push_back(r);
+            }
+        }
+    }
+
+    size_t n = rows.size();
+    CharacterVector chroms(n);
+    IntegerVector start(n), end(n), n_variants(n), n_snv(n), n_indel(n), n_other(n), ti(n), tv(n);
+    NumericVector ti_tv(n);
+    for (size_t i = 0; i < n; i++) {
+        const WindowCounts& r = rows[i];
+        chroms[i] = bcf_hdr_id2name(reader.hdr, r.rid);
+        start[i] = r.window * window;
+        end[i] = r.window * window + window;
+        n_variants[i] = r.n_variants;
+        n_snv[i] = r.n_snv;
+        n_indel[i] = r.n_indel;
+        n_other[i] = r.n_other;
+        ti[i] = r.n_ti;
+        tv[i] = r.n_tv;
+        ti_tv[i] = r.n_tv ? (double) r.n_ti / r.n_tv : NA_REAL;
+    }
+
+    return DataFrame::create(
+        Named("chrom") = chroms,
+        Named("start") = start,
+        Named("end") = end,
+        Named("n_variants") = n_variants,
+        Named("n_snv") = n_snv,
+        Named("n_indel") = n_indel,
+        Named("n_other") = n_other,
+        Named("ti") = ti,
+        Named("tv") = tv,
+        Named("ti_tv") = ti_tv
+    );
+}
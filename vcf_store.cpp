@@ -0,0 +1,453 @@
+#include<Rcpp.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "vcf_reader.h"
+#include "vcf_store.h"
+using namespace Rcpp;
+using namespace std;
+
+MappedFile::~MappedFile() {
+    if (data) munmap((void *) data, size);
+}
+
+bool MappedFile::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        data = p;
+    }
+    close(fd); // the mapping stays valid
+    return true;
+}
+
+bool GenotypeStore::is_store(const std::string& path) {
+    struct stat st;
+    return stat((path + "/meta.txt").c_str(), &st) == 0;
+}
+
+GenotypeStore::GenotypeStore(const std::string& path)
+    : path(path), n_samples(0), n_variants(0), bytes_per_variant(0), pos(NULL), rlen(NULL), gt(NULL) {
+    std::ifstream meta((path + "/meta.txt").c_str());
+    if (!meta) stop("couldn't read store %s", path);
+
+    std::string line, key;
+    while (std::getline(meta, line)) {
+        std::istringstream fields(line);
+        std::getline(fields, key, '\t');
+        if (key == "n_variants") {
+            fields >> n_variants;
+        } else if (key == "n_samples") {
+            fields >> n_samples;
+        } else if (key == "bytes_per_variant") {
+            fields >> bytes_per_variant;
+        } else if (key == "sample") {
+            std::string name;
+            std::getline(fields, name);
+            samples.push_back(name);
+        } else if (key == "contig") {
+            StoreContig contig;
+            std::getline(fields, contig.name, '\t');
+            fields >> contig.first >> contig.count >> contig.max_rlen;
+            contigs.push_back(contig);
+        } else if (key == "info") {
+            StoreInfo field;
+            std::getline(fields, field.tag, '\t');
+            fields >> field.kind;
+            info.push_back(field);
+        }
+    }
+
+    if (!pos_file.open(path + "/pos.bin") || !rlen_file.open(path + "/rlen.bin") || !gt_file.open(path + "/gt.bin")) {
+        stop("couldn't map the columns of store %s", path);
+    }
+    size_t rows = (size_t) n_variants;
+    if (pos_file.size != rows * sizeof(int32_t) || rlen_file.size != rows * sizeof(int32_t) ||
+        gt_file.size != rows * bytes_per_variant) {
+        stop("store %s is truncated", path);
+    }
+    pos = (const int32_t *) pos_file.data;
+    rlen = (const int32_t *) rlen_file.data;
+    gt = (const uint8_t *) gt_file.data;
+}
+
+std::vector<int64_t> GenotypeStore::query(const std::string& reg) const {
+    std::vector<int64_t> rows;
+    if (reg.empty()) {
+        for (int64_t row = 0; row < n_variants; row++) rows.push_back(row);
+        return rows;
+    }
+    int beg, end;
+    const char *q = hts_parse_reg(reg.c_str(), &beg, &end);
+    if (!q) stop("couldn't parse region %s", reg);
+    std::string chrom(reg.c_str(), q - reg.c_str());
+
+    for (size_t c = 0; c < contigs.size(); c++) {
+        if (contigs[c].name != chrom) continue;
+        // records starting up to max_rlen before the region can still overlap it
+        const int32_t *first = pos + contigs[c].first;
+        const int32_t *last = first + contigs[c].count;
+        int from = beg > INT_MIN + contigs[c].max_rlen ? beg - contigs[c].max_rlen : INT_MIN;
+        const int32_t *lo = std::lower_bound(first, last, from);
+        const int32_t *hi = std::lower_bound(lo, last, end);
+        for (const int32_t *p = lo; p < hi; p++) {
+            int64_t row = p - pos;
+            if ((int64_t) pos[row] + rlen[row] > beg) rows.push_back(row);
+        }
+        break;
+    }
+    return rows;
+}
+
+std::vector<int> GenotypeStore::sample_indices(const std::vector<std::string>& names) const {
+    std::vector<int> indices;
+    for (size_t i = 0; i < names.size(); i++) {
+        std::vector<std::string>::const_iterator it = std::find(samples.begin(), samples.end(), names[i]);
+        if (it == samples.end()) stop("sample %s not found in the store", names[i]);
+        indices.push_back(it - samples.begin());
+    }
+    return indices;
+}
+
+const double *GenotypeStore::info_column(const std::string& tag, MappedFile& file, int *kind) const {
+    for (size_t i = 0; i < info.size(); i++) {
+        if (info[i].tag != tag) continue;
+        if (!file.open(path + "/info_" + tag + ".bin") || file.size != n_variants * sizeof(double)) {
+            stop("couldn't map info field %s of store %s", tag, path);
+        }
+        *kind = info[i].kind;
+        return (const double *) file.data;
+    }
+    stop("info field %s was not stored; rebuild the store with it in `info`", tag);
+}
+
+std::vector<int> GenotypeStore::row_contig(const std::vector<int64_t>& rows) const {
+    std::vector<int> out(rows.size());
+    size_t c = 0;
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (c >= contigs.size() || rows[i] < contigs[c].first || rows[i] >= contigs[c].first + contigs[c].count) {
+            for (c = 0; c < contigs.size(); c++) {
+                if (rows[i] >= contigs[c].first && rows[i] < contigs[c].first + contigs[c].count) break;
+            }
+        }
+        out[i] = c;
+    }
+    return out;
+}
+
+struct StoreDecode {
+    const GenotypeStore *store;
+    const std::vector<int64_t> *rows;
+    const std::vector<int> *keep;
+    int *out;
+    bool transpose;
+    int n_tasks;
+    std::vector<char> *missing; // per task
+};
+
+static void decode_variant(const StoreDecode& d, size_t v, int *out, char *missing) {
+    const uint8_t *row = d.store->gt + (*d.rows)[v] * d.store->bytes_per_variant;
+    for (size_t s = 0; s < d.keep->size(); s++) {
+        for (int j = 0; j < 2; j++) {
+            int h = 2 * (*d.keep)[s] + j;
+            int code = (row[h >> 2] >> ((h & 3) * 2)) & 3;
+            if (code == 3) *missing = 1;
+            out[2 * s + j] = code;
+        }
+    }
+}
+
+// tasks take 64-variant tiles in turn. A transposed tile is decoded into a
+// scratch buffer first and then written out haplotype by haplotype.
+static void decode_task(void *arg, int task) {
+    StoreDecode& d = *(StoreDecode *) arg;
+    const size_t tile = 64;
+    size_t n_haps = 2 * d.keep->size(), n_rows = d.rows->size();
+    std::vector<int> scratch(d.transpose ? tile * n_haps : 0);
+    for (size_t v0 = task * tile; v0 < n_rows; v0 += d.n_tasks * tile) {
+        size_t v1 = std::min(n_rows, v0 + tile);
+        for (size_t v = v0; v < v1; v++) {
+            int *out = d.transpose ? &scratch[(v - v0) * n_haps] : d.out + v * n_haps;
+            decode_variant(d, v, out, &(*d.missing)[task]);
+        }
+        if (d.transpose && n_haps) transpose_tiled(&scratch[0], v1 - v0, n_haps, d.out, n_rows, v0);
+    }
+}
+
+SEXP store_extract_genotypes(const std::string& path, const std::string& reg,
+                             const std::vector<std::string>& samples, int threads, bool transpose) {
+    GenotypeStore store(path);
+    Rcout << "reading genotype store " << path << endl;
+    std::vector<int> keep;
+    if (samples.empty()) {
+        for (int i = 0; i < store.n_samples; i++) keep.push_back(i);
+    } else {
+        keep = store.sample_indices(samples);
+    }
+    Rprintf("detecting %d samples\n", (int) keep.size());
+
+    std::vector<int64_t> rows = store.query(reg);
+    IntegerVector genotypes(rows.size() * 2 * keep.size());
+    int n_tasks = std::max(1, threads);
+    std::vector<char> missing(n_tasks, 0);
+    StoreDecode decode = {&store, &rows, &keep, genotypes.begin(), transpose, n_tasks, &missing};
+    parallel_for(n_tasks, threads, decode_task, &decode);
+    if (std::find(missing.begin(), missing.end(), 1) != missing.end()) stop("missing value support not yet added");
+
+    if (transpose) {
+        genotypes.attr("dim") = Dimension(rows.size(), 2 * keep.size()); // variants x haplotypes
+    } else {
+        genotypes.attr("dim") = Dimension(2 * keep.size(), rows.size()); // haplotypes x variants
+    }
+    return genotypes;
+}
+
+DataFrame store_extract_info(const std::string& path, const std::string& reg, const std::vector<std::string>& tags) {
+    GenotypeStore store(path);
+    Rcout << "reading genotype store " << path << endl;
+    std::vector<int64_t> rows = store.query(reg);
+    std::vector<int> contig = store.row_contig(rows);
+    size_t n = rows.size();
+
+    CharacterVector chroms(n);
+    IntegerVector positions(n);
+    for (size_t i = 0; i < n; i++) {
+        chroms[i] = store.contigs[contig[i]].name;
+        positions[i] = store.pos[rows[i]];
+    }
+
+    List columns(2 + tags.size());
+    CharacterVector names(2 + tags.size());
+    columns[0] = chroms;
+    names[0] = "chrom";
+    columns[1] = positions;
+    names[1] = "pos";
+    for (size_t t = 0; t < tags.size(); t++) {
+        MappedFile file;
+        int kind;
+        const double *values = store.info_column(tags[t], file, &kind);
+        if (kind == STORE_REAL) {
+            NumericVector out(n);
+            for (size_t i = 0; i < n; i++) out[i] = values[rows[i]];
+            columns[2 + t] = out;
+        } else {
+            IntegerVector out(n);
+            for (size_t i = 0; i < n; i++) out[i] = ISNAN(values[rows[i]]) ? NA_INTEGER : (int) values[rows[i]];
+            columns[2 + t] = kind == STORE_FLAG ? (SEXP) LogicalVector(out) : (SEXP) out;
+        }
+        names[2 + t] = tags[t];
+    }
+    return make_data_frame(columns, names, n);
+}
+
+class ColumnWriter {
+public:
+    ColumnWriter(const std::string& path) : path(path), fp(fopen(path.c_str(), "wb")) {
+        if (!fp) stop("couldn't write %s", path);
+    }
+    ~ColumnWriter() {
+        if (fp) fclose(fp);
+    }
+    void write(const void *data, size_t size) {
+        if (size && fwrite(data, 1, size, fp) != size) stop("couldn't write %s", path);
+    }
+
+private:
+    std::string path;
+    FILE *fp;
+};
+
+//' convert a VCF/BCF into a memory-mapped columnar genotype store
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path
+//' @param reg one or more region queries of the form: chr:start-end. Each contig must be covered by one
+//' run of consecutive regions, in order; records already stored by an earlier region are skipped.
+//' @param store the directory to write the store to. It is created if needed.
+//' @param info an optional character vector of Flag, or Number=1 Integer/Float, INFO fields to store as columns
+//' @param samples an optional character vector of sample names to keep. Other samples are never decoded.
+//' @param threads the number of threads used for BGZF decompression
+//' @description Use this function once to pay the BGZF inflate and BCF decode cost up front for data that is
+//' queried many times. The store keeps a 2-bit genotype matrix (one code per haplotype), the position and
+//' reference length of each record, and the requested INFO fields as flat binary columns. Passing the store
+//' directory as the vcf argument of extract_genotypes or extract_info then answers region queries by binary
+//' search on the memory-mapped position column, without decompressing or parsing anything.
+//' @details Genotype codes are the allele index, and missing calls (or the absent second haplotype of haploid
+//' calls) are stored as missing. Two bits leave room for allele indices up to 2 only, so a call of a fourth or
+//' later allele is an error; split multiallelic records first (e.g. bcftools norm -m-).
+//' @examples
+//' \dontrun{
+//' build_genotype_store(vcf, index, "1", "chr1_store", info = c("AC", "AF"))
+//' extract_genotypes("chr1_store", "", "1:10001-100500")
+//' }
+// [[Rcpp::export]]
+void build_genotype_store(std::string vcf, std::string index, std::vector<std::string> reg, std::string store,
+                          Nullable<CharacterVector> info = R_NilValue, Nullable<CharacterVector> samples = R_NilValue,
+                          int threads = 1) {
+    VcfSource source = {vcf, index};
+    if (samples.isNotNull()) source.samples = as<std::vector<std::string> >(samples.get());
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+    reader.set_threads(threads);
+    bcf_hdr_t *hdr = reader.hdr;
+
+    std::vector<StoreInfo> fields;
+    if (info.isNotNull()) {
+        std::vector<std::string> tags = as<std::vector<std::string> >(info.get());
+        for (size_t t = 0; t < tags.size(); t++) {
+            int id = bcf_hdr_id2int(hdr, BCF_DT_ID, tags[t].c_str());
+            if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id)) stop("info field %s does not exist", tags[t]);
+            int type = bcf_hdr_id2type(hdr, BCF_HL_INFO, id);
+            bool scalar = bcf_hdr_id2length(hdr, BCF_HL_INFO, id) == BCF_VL_FIXED &&
+                          bcf_hdr_id2number(hdr, BCF_HL_INFO, id) == 1;
+            StoreInfo field = {tags[t], STORE_REAL};
+            if (type == BCF_HT_FLAG) {
+                field.kind = STORE_FLAG;
+            } else if (type == BCF_HT_INT && scalar) {
+                field.kind = STORE_INT;
+            } else if (type != BCF_HT_REAL || !scalar) {
+                stop("info field %s is not a Flag or a Number=1 Integer/Float", tags[t]);
+            }
+            fields.push_back(field);
+        }
+    }
+
+    if (mkdir(store.c_str(), 0755) != 0 && errno != EEXIST) stop("couldn't create store directory %s", store);
+    // meta.txt is written last, so a build that stops part way never leaves a store that looks complete
+    unlink((store + "/meta.txt").c_str());
+    ColumnWriter pos_out(store + "/pos.bin");
+    ColumnWriter rlen_out(store + "/rlen.bin");
+    ColumnWriter gt_out(store + "/gt.bin");
+    std::vector<ColumnWriter*> info_out;
+    for (size_t t = 0; t < fields.size(); t++) info_out.push_back(new ColumnWriter(store + "/info_" + fields[t].tag + ".bin"));
+    struct Cleanup {
+        std::vector<ColumnWriter*>& writers;
+        ~Cleanup() { for (size_t i = 0; i < writers.size(); i++) delete writers[i]; }
+    } cleanup = {info_out};
+
+    int n_samples = bcf_hdr_nsamples(hdr);
+    int bytes_per_variant = (2 * n_samples + 3) / 4;
+    std::vector<uint8_t> packed(bytes_per_variant);
+    HtsBuffer<int32_t> gt_arr;
+    HtsBuffer<int32_t> int_arr;
+    HtsBuffer<float> float_arr;
+
+    // indexed by rid and grown on demand, as vcf_parse adds contigs missing from the header
+    std::vector<StoreContig> contigs;
+    std::vector<char> contig_seen;
+    std::vector<int> covered_end;
+    int64_t n_variants = 0;
+    int last_pos = 0;
+    BcfRecord record;
+    bcf1_t *line = record.line;
+
+    for (size_t r = 0; r < reg.size(); r++) {
+        if (!reader.query(reg[r])) stop(reader.error);
+        int ret;
+        while ((ret = reader.next(line)) >= 0) {
+            if (line->rid >= (int) covered_end.size()) {
+                covered_end.resize(line->rid + 1, INT_MIN);
+                contig_seen.resize(line->rid + 1, 0);
+            }
+            if (line->pos < covered_end[line->rid]) continue; // stored by an earlier region
+
+            if (contigs.empty() || contigs.back().name != bcf_hdr_id2name(hdr, line->rid)) {
+                if (contig_seen[line->rid]) stop("reg must cover each contig in one run of consecutive regions");
+                contig_seen[line->rid] = 1;
+                StoreContig contig = {bcf_hdr_id2name(hdr, line->rid), n_variants, 0, 0};
+                contigs.push_back(contig);
+            }
+            StoreContig& contig = contigs.back();
+            if (contig.count && line->pos < last_pos) stop("records of %s are not sorted", contig.name);
+            last_pos = line->pos;
+
+            int32_t pos = line->pos, rlen = line->rlen;
+            pos_out.write(&pos, sizeof(pos));
+            rlen_out.write(&rlen, sizeof(rlen));
+            contig.count++;
+            contig.max_rlen = std::max(contig.max_rlen, rlen);
+
+            int ngt = bcf_get_genotypes(hdr, line, &gt_arr.p, &gt_arr.n);
+            int max_ploidy = ngt > 0 && n_samples > 0 ? ngt / n_samples : 0;
+            std::fill(packed.begin(), packed.end(), 0);
+            for (int i = 0; i < n_samples; i++) {
+                for (int j = 0; j < 2; j++) {
+                    int h = 2 * i + j, code = 3;
+                    if (j < max_ploidy) {
+                        int32_t g = gt_arr.p[i * max_ploidy + j];
+                        if (g != bcf_int32_vector_end && !bcf_gt_is_missing(g)) {
+                            code = bcf_gt_allele(g);
+                            // code 3 is taken by missing calls
+                            if (code > 2) {
+                                stop("%s:%d has a call of allele %d, which a store can't hold; split multiallelic "
+                                     "records first", contig.name, line->pos + 1, code);
+                            }
+                        }
+                    }
+                    packed[h >> 2] |= code << ((h & 3) * 2);
+                }
+            }
+            gt_out.write(&packed[0], bytes_per_variant);
+
+            for (size_t t = 0; t < fields.size(); t++) {
+                const char *tag = fields[t].tag.c_str();
+                double value = NA_REAL;
+                if (fields[t].kind == STORE_FLAG) {
+                    value = bcf_get_info_flag(hdr, line, tag, NULL, NULL) == 1;
+                } else if (fields[t].kind == STORE_INT) {
+                    if (bcf_get_info_int32(hdr, line, tag, &int_arr.p, &int_arr.n) > 0 && int_arr.p[0] != bcf_int32_missing) {
+                        value = int_arr.p[0];
+                    }
+                } else {
+                    if (bcf_get_info_float(hdr, line, tag, &float_arr.p, &float_arr.n) > 0 && !bcf_float_is_missing(float_arr.p[0])) {
+                        value = float_arr.p[0];
+                    }
+                }
+                info_out[t]->write(&value, sizeof(value));
+            }
+            n_variants++;
+        }
+        if (ret < -1) stop(reader.error);
+
+        int beg, end;
+        const char *q = hts_parse_reg(reg[r].c_str(), &beg, &end);
+        if (q) {
+            int rid = bcf_hdr_name2id(hdr, std::string(reg[r].c_str(), q - reg[r].c_str()).c_str());
+            if (rid >= 0) covered_end[rid] = std::max(covered_end[rid], end);
+        }
+        checkUserInterrupt();
+    }
+
+    std::ofstream meta((store + "/meta.txt").c_str());
+    meta << "htslibr_store\t1\n";
+    meta << "n_variants\t" << n_variants << "\n";
+    meta << "n_samples\t" << n_samples << "\n";
+    meta << "bytes_per_variant\t" << bytes_per_variant << "\n";
+    for (int i = 0; i < n_samples; i++) meta << "sample\t" << hdr->samples[i] << "\n";
+    for (size_t c = 0; c < contigs.size(); c++) {
+        meta << "contig\t" << contigs[c].name << "\t" << contigs[c].first << "\t" << contigs[c].count << "\t"
+             << contigs[c].max_rlen << "\n";
+    }
+    for (size_t t = 0; t < fields.size(); t++) meta << "info\t" << fields[t].tag << "\t" << fields[t].kind << "\n";
+    if (!meta) stop("couldn't write %s/meta.txt", store);
+    Rprintf("stored %lld variants for %d samples in %s\n", (long long) n_variants, n_samples, store.c_str());
+}
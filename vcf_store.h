@@ -0,0 +1,88 @@
+#ifndef HTSLIBR_VCF_STORE_H
+#define HTSLIBR_VCF_STORE_H
+
+#include<Rcpp.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// a read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() : data(NULL), size(0) {}
+    ~MappedFile();
+    bool open(const std::string& path);
+
+    const void *data;
+    size_t size;
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+struct StoreContig {
+    std::string name;
+    int64_t first;
+    int64_t count;
+    int max_rlen;
+};
+
+enum StoreInfoKind { STORE_FLAG, STORE_INT, STORE_REAL };
+
+struct StoreInfo {
+    std::string tag;
+    int kind;
+};
+
+// a columnar genotype store written by build_genotype_store. Every column is
+// memory-mapped, so queries read straight from the page cache:
+//   meta.txt       samples, contigs (first row, count, longest record) and INFO columns
+//   pos.bin        int32 0-based start of each record, sorted within a contig
+//   rlen.bin       int32 reference length of each record
+//   gt.bin         2 bits per haplotype (0, 1, 2 = allele index, 3 = missing),
+//                  bytes_per_variant bytes per record
+//   info_<TAG>.bin double per record, NA when missing
+class GenotypeStore {
+public:
+    static bool is_store(const std::string& path);
+
+    GenotypeStore(const std::string& path);
+
+    // rows of the records overlapping reg, in order; every row when reg is empty
+    std::vector<int64_t> query(const std::string& reg) const;
+    // index of each sample name, or stop() if one is unknown
+    std::vector<int> sample_indices(const std::vector<std::string>& names) const;
+    // map the column of an INFO tag stored at build time; stop() if it wasn't
+    const double *info_column(const std::string& tag, MappedFile& file, int *kind) const;
+    // contig of each row
+    std::vector<int> row_contig(const std::vector<int64_t>& rows) const;
+
+    std::string path;
+    int n_samples;
+    int64_t n_variants;
+    int bytes_per_variant;
+    std::vector<std::string> samples;
+    std::vector<StoreContig> contigs;
+    std::vector<StoreInfo> info;
+
+    const int32_t *pos;
+    const int32_t *rlen;
+    const uint8_t *gt;
+
+private:
+    GenotypeStore(const GenotypeStore&);
+    GenotypeStore& operator=(const GenotypeStore&);
+
+    MappedFile pos_file;
+    MappedFile rlen_file;
+    MappedFile gt_file;
+};
+
+// the store-backed paths of extract_genotypes and extract_info
+SEXP store_extract_genotypes(const std::string& store, const std::string& reg,
+                             const std::vector<std::string>& samples, int threads, bool transpose);
+Rcpp::DataFrame store_extract_info(const std::string& store, const std::string& reg,
+                                   const std::vector<std::string>& tags);
+
+#endif
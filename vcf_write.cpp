@@ -0,0 +1,114 @@
+#include<Rcpp.h>
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include "vcf_reader.h"
+using namespace Rcpp;
+using namespace std;
+
+// owns the output side of write_vcf so stop() part way through still closes the file
+struct VcfWriter {
+    VcfWriter() : fp(NULL), hdr(NULL) {}
+    ~VcfWriter() {
+        if (fp) hts_close(fp);
+        if (hdr) bcf_hdr_destroy(hdr);
+    }
+    htsFile *fp;
+    bcf_hdr_t *hdr;
+};
+
+static bool ends_with(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+//' write a region, sample and site subset of a VCF/BCF to a new file
+//' @param vcf the VCF/BCF file path
+//' @param index the CSI/TBI index file path, or NULL to read an unindexed file (reg must be NULL too)
+//' @param reg a region query of the form: chr:start-end, or NULL to stream the whole file
+//' @param out the output path. A name ending in .bcf writes BCF, .gz writes bgzipped VCF, anything else plain VCF.
+//' @param samples an optional character vector of sample names to keep, in the order given
+//' @param filter an optional site filter expression, as in extract_genotypes. Sites failing it are dropped before
+//' their FORMAT fields are decoded.
+//' @param level the compression level (0-9) of BCF and bgzipped VCF output, or -1 for the htslib default
+//' @param write_index build a CSI index (out.csi) while writing. Only BCF output can be indexed on the fly, so by
+//' default BCF output is indexed and VCF output is not.
+//' @param threads the number of threads used to decompress the input and, separately, to compress the output
+//' @description Use this function to save a subset straight back to disk for other tools in one streaming pass,
+//' instead of extracting it into R or shelling out to bcftools. Records that need no sample subsetting are
+//' copied without being decoded. The output header is the input's, so a VCF whose records use contigs or tags its
+//' header doesn't declare is an error; add them to the header (e.g. with bcftools reheader) first.
+//' @return the number of records written
+//' @examples
+//' \dontrun{
+//' write_vcf(vcf, index, "1:10001-100500", "subset.bcf", samples = c("NA12878", "NA12891"),
+//'           filter = 'FILTER == "PASS" && QUAL > 30', threads = 4)
+//' }
+// [[Rcpp::export]]
+int write_vcf(std::string vcf, Nullable<CharacterVector> index, Nullable<CharacterVector> reg, std::string out,
+              Nullable<CharacterVector> samples = R_NilValue, std::string filter = "", int level = -1,
+              Nullable<LogicalVector> write_index = R_NilValue, int threads = 1) {
+    bool is_bcf = ends_with(out, ".bcf");
+    bool indexed = write_index.isNull() ? is_bcf : as<bool>(write_index.get());
+    if (indexed && !is_bcf) stop("only BCF output can be indexed while writing; use write_index = FALSE and tabix");
+    std::string mode = is_bcf ? "wb" : ends_with(out, ".gz") ? "wz" : "w";
+    if (level >= 0 && mode != "w") mode += std::to_string(std::min(level, 9));
+
+    // samples are subset with bcf_subset on the way out, not on read, so the
+    // output header and records agree on the sample list and order
+    VcfSource source = {vcf, optional_string(index)};
+    source.filter = filter;
+    VcfReader reader(source, true);
+    if (!reader.ok()) stop(reader.error);
+    reader.set_threads(threads);
+    bcf_hdr_t *hdr = reader.hdr;
+
+    VcfWriter writer;
+    std::vector<int> imap;
+    if (samples.isNotNull()) {
+        std::vector<std::string> keep = as<std::vector<std::string> >(samples.get());
+        std::vector<char*> names(keep.size());
+        for (size_t i = 0; i < keep.size(); i++) names[i] = &keep[i][0];
+        imap.resize(keep.size());
+        writer.hdr = bcf_hdr_subset(hdr, keep.size(), keep.empty() ? NULL : &names[0], keep.empty() ? NULL : &imap[0]);
+        for (size_t i = 0; i < keep.size(); i++) {
+            if (imap[i] < 0) stop("sample %s not found in the header", keep[i]);
+        }
+    } else {
+        writer.hdr = bcf_hdr_dup(hdr);
+    }
+    if (!writer.hdr) stop("couldn't build the output header");
+
+    writer.fp = hts_open(out.c_str(), mode.c_str());
+    if (!writer.fp) stop("couldn't write %s", out);
+    if (threads > 1) hts_set_threads(writer.fp, threads);
+    if (bcf_hdr_write(writer.fp, writer.hdr) < 0) stop("couldn't write the header of %s", out);
+    std::string out_index = out + ".csi";
+    if (indexed && bcf_idx_init(writer.fp, writer.hdr, 14, out_index.c_str()) < 0) {
+        stop("couldn't start an index for %s", out);
+    }
+
+    // the header is already written, so anything vcf_parse has to add to the
+    // input's header while reading can't be declared in the output any more
+    int n_ids = hdr->n[BCF_DT_ID], n_contigs = hdr->n[BCF_DT_CTG];
+    BcfRecord record;
+    bcf1_t *line = record.line;
+    if (!reader.query(optional_string(reg))) stop(reader.error);
+    int n = 0, r;
+    while ((r = reader.next(line)) >= 0) {
+        if (hdr->n[BCF_DT_ID] != n_ids || hdr->n[BCF_DT_CTG] != n_contigs) {
+            stop("%s uses contigs or tags its header doesn't declare; add them to the header first", vcf);
+        }
+        if (samples.isNotNull() && bcf_subset(hdr, line, imap.size(), imap.empty() ? NULL : &imap[0]) < 0) {
+            stop("couldn't subset samples");
+        }
+        if (bcf_write(writer.fp, writer.hdr, line) < 0) stop("couldn't write a record to %s", out);
+        if (++n % 100000 == 0) checkUserInterrupt();
+    }
+    if (r < -1) stop(reader.error);
+
+    if (indexed && bcf_idx_save(writer.fp) < 0) stop("couldn't save the index %s", out_index);
+    int ret = hts_close(writer.fp);
+    writer.fp = NULL;
+    if (ret < 0) stop("couldn't finish writing %s", out);
+    Rprintf("wrote %d records to %s\n", n, out.c_str());
+    return n;
+}